@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,27 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// binit() sizes the cache from the amount of free memory, one
+// BCACHEFRAC'th of it. Buffer headers live in a paged array; each
+// buffer's data is a BSIZE slice of a page-aligned kalloc() page
+// shared by BPP consecutive headers. When kalloc() runs dry it calls
+// bshrink(), which gives back data pages whose buffers are all unused,
+// down to a floor of NBUFMIN buffers: NBUF, plus all the buffers the
+// log can keep pinned until it checkpoints. When bget() finds few
+// unused buffers left, bgrow() takes pages back while memory is
+// plentiful again, and if there are none at all, bget() waits for
+// the checkpointer to unpin some.
+//
+// Locking:
+// * bcache.bucket[h].lock protects the hash chain of bucket h
+//   and the refcnt of every buffer on that chain.
+// * bcache.lrulock protects the LRU list of unreferenced
+//   buffers, which is where bget() finds buffers to recycle.
+// * bcache.evictlock serializes recycling, so that only one
+//   CPU at a time changes the identity (dev, blockno) of a
+//   buffer or inserts a buffer into a hash chain.
+// Locks are acquired in the order evictlock, bucket lock, lrulock.
 
 
 #include "types.h"
@@ -23,96 +44,458 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13  // prime, so that hashing spreads sequential blocks
+#define NGROW    8  // pages bgrow() takes back at a time
+
+#define BPP (PGSIZE / BSIZE)  // buffers per data page
+// headers per header page, a multiple of BPP so that the
+// buffers sharing a data page are adjacent in the same header page.
+#define HPP ((PGSIZE / sizeof(struct buf)) / BPP * BPP)
+#define NHDRPAGE (PGSIZE / sizeof(struct buf *))
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // chain through buf.hnext
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock evictlock;
+  struct buf **hdr;  // page of pointers to header pages
+  int nbuf;          // number of headers
+  int nlive;         // number of headers with data pages
+  int shrinkpos;     // where bshrink() looks next
+  int growpos;       // where bgrow() looks next
+  struct bucket bucket[NBUCKET];
+
+  // Doubly-linked list of buffers with refcnt == 0,
+  // through prev/next. head.next is least recently used,
+  // head.prev is most recently used.
+  struct spinlock lrulock;
+  struct buf lru;
+  int nlru;          // buffers on the LRU list
 } bcache;
 
+static void bput(struct buf*);
+static void bsubmit(struct buf**, int, int);
+
+// the i'th buffer header.
+static struct buf*
+bhdr(int i)
+{
+  return &bcache.hdr[i / HPP][i % HPP];
+}
+
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// Append b to the most-recently-used end of the LRU list.
+// Caller must hold b's bucket lock.
+static void
+lru_push(struct buf *b)
+{
+  acquire(&bcache.lrulock);
+  b->prev = bcache.lru.prev;
+  b->next = &bcache.lru;
+  bcache.lru.prev->next = b;
+  bcache.lru.prev = b;
+  bcache.nlru++;
+  release(&bcache.lrulock);
+}
+
+// Remove b from the LRU list.
+// Caller must hold b's bucket lock.
+static void
+lru_remove(struct buf *b)
+{
+  acquire(&bcache.lrulock);
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  b->next = b->prev = 0;
+  bcache.nlru--;
+  release(&bcache.lrulock);
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  char *data;
+  int i, n;
+
+  initlock(&bcache.evictlock, "bcache.evict");
+  initlock(&bcache.lrulock, "bcache.lru");
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
 
-  initlock(&bcache.lock, "bcache");
+  // One BCACHEFRAC'th of free memory, but at least NBUFMIN and
+  // at most what one page of header-page pointers can describe.
+  n = kfreepages() / BCACHEFRAC * BPP;
+  if(n < NBUFMIN)
+    n = NBUFMIN;
+  if(n > NHDRPAGE * HPP)
+    n = NHDRPAGE * HPP;
+  n = (n + BPP - 1) / BPP * BPP;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  if((bcache.hdr = kalloc()) == 0)
+    panic("binit: kalloc");
+  memset(bcache.hdr, 0, PGSIZE);
+
+  // All buffers start out unused and unhashed,
+  // on the LRU list.
+  bcache.lru.prev = &bcache.lru;
+  bcache.lru.next = &bcache.lru;
+  data = 0;
+  for(i = 0; i < n; i++){
+    if(i % HPP == 0 && (bcache.hdr[i / HPP] = kalloc()) == 0)
+      break;
+    if(i % BPP == 0 && (data = kalloc()) == 0)
+      break;
+    b = bhdr(i);
+    memset(b, 0, sizeof(*b));
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = (uchar*)data + (i % BPP) * BSIZE;
+    b->next = &bcache.lru;
+    b->prev = bcache.lru.prev;
+    bcache.lru.prev->next = b;
+    bcache.lru.prev = b;
+    bcache.nbuf = bcache.nlive = bcache.nlru = i + 1;
   }
+  if(bcache.nbuf < NBUFMIN)
+    panic("binit: too few buffers");
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block on device dev in bucket bk.
+// If found, take a reference to it.
+// Caller must hold bk->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->hnext){
     if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      if(b->refcnt++ == 0)
+        lru_remove(b);
       return b;
     }
   }
+  return 0;
+}
+
+// Remove b from the hash chain of bucket bk.
+// Caller must hold bk->lock.
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      b->hnext = 0;
+      return;
+    }
+  }
+}
+
+// Take the least recently used unreferenced buffer off the
+// LRU list and out of its hash chain, so that the caller owns it.
+// Returns 0 if every buffer is in use.
+// Caller must hold bcache.evictlock.
+static struct buf*
+bevict(void)
+{
+  struct buf *b;
+  struct bucket *bk;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  for(;;){
+    acquire(&bcache.lrulock);
+    b = bcache.lru.next;
+    release(&bcache.lrulock);
+    if(b == &bcache.lru)
+      return 0;
+
+    // b's identity cannot change while we hold evictlock,
+    // but a hit in bfind() may take a reference to it
+    // before we get its bucket lock. If so, try again.
+    bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    if(b->refcnt == 0){
+      lru_remove(b);
+      bunhash(bk, b);
+      release(&bk->lock);
       return b;
     }
+    release(&bk->lock);
   }
-  panic("bget: no buffers");
 }
 
-// Return a locked buf with the contents of the indicated block.
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// If ahead is set, the caller only wants a buffer to read
+// ahead into: return 0 if the block is already cached.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  struct buf *b;
+  struct bucket *bk = &bcache.bucket[bhash(dev, blockno)];
+
+  // Is the block already cached?
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    goto found;
+
+  // Running low on buffers to recycle? Take back pages
+  // that bshrink() gave away, if memory allows.
+  if(bshort())
+    bgrow();
+
+  // Not cached. Only CPUs holding evictlock insert into
+  // hash chains, so look again once we hold it.
+  for(;;){
+    acquire(&bcache.evictlock);
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno);
+    release(&bk->lock);
+    if(b){
+      release(&bcache.evictlock);
+      goto found;
+    }
+
+    // Recycle the least recently used (LRU) unused buffer.
+    if((b = bevict()) != 0)
+      break;
+    release(&bcache.evictlock);
+
+    // All in use, most likely pinned by the log until
+    // it checkpoints. Wait for the checkpointer.
+    if(log_unpin() < 0)
+      panic("bget: no buffers");
+  }
+
+  // No one else can reach b, so acquiresleep() won't block.
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.evictlock);
+
+  acquiresleep(&b->lock);
+  return b;
+
+found:
+  if(ahead){
+    bput(b);
+    return 0;
+  }
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Return a locked buf for the indicated block, with a read
+// of its contents started if they are not yet cached.
+// Call bwait() before looking at b->data. Lets a caller
+// keep several reads in flight at once.
 struct buf*
-bread(uint dev, uint blockno)
+bread_async(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+    b->async = 0;
+    bsubmit(&b, 1, 0);
   }
   return b;
 }
 
+// Wait for the read or write started on locked buf b
+// by bread_async() or bwrite_async() to finish.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+  b->valid = 1;
+}
+
+// Return a locked buf with the contents of the indicated block.
+struct buf*
+bread(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bread_async(dev, blockno);
+  bwait(b);
+  return b;
+}
+
+// Return a locked buf for the indicated block without
+// reading it from disk, for a caller that is about to
+// overwrite all of b->data.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
+// Is the indicated block in the cache? For a caller that reads
+// or writes the disk around the cache; the answer stays good only
+// while the caller keeps everyone else from using the block.
+int
+bcached(uint dev, uint blockno)
+{
+  struct bucket *bk = &bcache.bucket[bhash(dev, blockno)];
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  return b != 0;
+}
+
+// Start reading the n indicated blocks into the cache,
+// skipping those already there, and return without waiting.
+// Runs of consecutive blocks are read with one disk request.
+void
+breadahead(uint dev, uint *blocks, int n)
+{
+  struct buf *b, *run[MAXSEG];
+  int i, m;
+
+  m = 0;
+  for(i = 0; i < n; i++){
+    if(m > 0 && (m == MAXSEG || blocks[i] != run[m-1]->blockno + 1)){
+      bsubmit(run, m, 0);
+      m = 0;
+    }
+    if((b = bget(dev, blocks[i], 1)) != 0){
+      b->async = 1;
+      run[m++] = b;
+    }
+  }
+  if(m > 0)
+    bsubmit(run, m, 0);
+}
+
+// Called by the disk driver when a read started by
+// breadahead() has finished.
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start writing b's contents to disk.  Must be locked.
+// Call bwait() before releasing or changing b.
+void
+bwrite_async(struct buf *b)
+{
+  bwritev(&b, 1);
+}
+
+// Start writing the n locked bufs in bs to disk, as bwrite_async()
+// would. Runs of bufs holding consecutive blocks of the same device
+// go to the disk as one request.
+void
+bwritev(struct buf **bs, int n)
+{
+  int i, j;
+
+  for(i = 0; i < n; i = j){
+    for(j = i; j < n; j++){
+      if(j > i && (j - i == MAXSEG || bs[j]->dev != bs[i]->dev ||
+                   bs[j]->blockno != bs[j-1]->blockno + 1))
+        break;
+      if(!holdingsleep(&bs[j]->lock))
+        panic("bwrite");
+      bs[j]->async = 0;
+    }
+    bsubmit(bs + i, j - i, 1);
+  }
+}
+
+// Write the n locked bufs in bs to disk, wait for
+// them, and release them.
+void
+bflush(struct buf **bs, int n)
+{
+  int i;
+
+  bwritev(bs, n);
+  for(i = 0; i < n; i++){
+    bwait(bs[i]);
+    brelse(bs[i]);
+  }
+}
+
+// Hand the n locked bufs in bs, which hold consecutive blocks
+// of one device, to the disk as a single request.
+static void
+bsubmit(struct buf **bs, int n, int write)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    bs[i]->qnext = i + 1 < n ? bs[i+1] : 0;
+  virtio_disk_submit(bs[0], write);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bwrite_async(b);
+  bwait(b);
+}
+
+// Like bwait(), but spin for a while rather than going straight
+// to sleep. For short writes that a caller must wait for before
+// it can do anything else, such as a log commit.
+void
+bwait_poll(struct buf *b)
+{
+  virtio_disk_poll(b);
+  b->valid = 1;
+}
+
+// Drop a reference to b. If it was the last one,
+// make b the most recently used candidate for recycling.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  if(b->refcnt < 1)
+    panic("bput");
+  if(--b->refcnt == 0)
+    lru_push(b);
+  release(&bk->lock);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If no one else holds it, move it to the
+// most-recently-used end of the LRU list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +503,136 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
+}
+
+// Give back up to npages data pages to kalloc(), taking
+// them from groups of BPP buffers that are all unreferenced.
+// Returns the number of pages freed.
+int
+bshrink(int npages)
+{
+  struct buf *b, *first;
+  struct bucket *bk[BPP];
+  int i, j, k, n, nlock, freed;
+  void *page;
+
+  if(bcache.hdr == 0)
+    return 0;
+
+  freed = 0;
+  acquire(&bcache.evictlock);
+  for(n = 0; n < bcache.nbuf / BPP && freed < npages; n++){
+    if(bcache.nlive - BPP < NBUFMIN)
+      break;
+    first = bhdr(bcache.shrinkpos);
+    bcache.shrinkpos = (bcache.shrinkpos + BPP) % bcache.nbuf;
+    if(first->data == 0)
+      continue;
+
+    // Lock the buckets of all buffers sharing this page,
+    // in bucket order; we hold evictlock, so no one else
+    // holds more than one bucket lock.
+    nlock = 0;
+    for(i = 0; i < NBUCKET; i++){
+      for(j = 0; j < BPP; j++){
+        if(bhash(first[j].dev, first[j].blockno) == i){
+          bk[nlock++] = &bcache.bucket[i];
+          acquire(&bcache.bucket[i].lock);
+          break;
+        }
+      }
+    }
+
+    for(j = 0; j < BPP; j++)
+      if(first[j].refcnt != 0)
+        break;
+    if(j == BPP){
+      page = first->data;
+      for(j = 0; j < BPP; j++){
+        b = &first[j];
+        lru_remove(b);
+        bunhash(&bcache.bucket[bhash(b->dev, b->blockno)], b);
+        b->data = 0;
+        b->valid = 0;
+      }
+      bcache.nlive -= BPP;
+    } else {
+      page = 0;
+    }
+
+    for(k = nlock - 1; k >= 0; k--)
+      release(&bk[k]->lock);
+    if(page){
+      kfree(page);
+      freed++;
+    }
+  }
+  release(&bcache.evictlock);
+  return freed;
+}
+
+// Give data pages back to up to NGROW groups of buffers that
+// bshrink() took them from, as long as memory isn't short:
+// more than the whole cache's worth of pages is free.
+void
+bgrow(void)
+{
+  struct buf *first;
+  char *page;
+  int i, n, j;
+
+  for(i = 0; i < NGROW && bcache.nlive < bcache.nbuf; i++){
+    if(kfreepages() <= bcache.nbuf / BPP || (page = kalloc()) == 0)
+      return;
+
+    // the buffers of a page bshrink() freed are unhashed
+    // and off the LRU list, so no one else can reach them.
+    acquire(&bcache.evictlock);
+    first = 0;
+    for(n = 0; n < bcache.nbuf / BPP && first == 0; n++){
+      first = bhdr(bcache.growpos);
+      bcache.growpos = (bcache.growpos + BPP) % bcache.nbuf;
+      if(first->data != 0)
+        first = 0;
+    }
+    if(first == 0){
+      release(&bcache.evictlock);
+      kfree(page);
+      return;
+    }
+    for(j = 0; j < BPP; j++){
+      first[j].data = (uchar*)page + j * BSIZE;
+      first[j].valid = 0;
+      lru_push(&first[j]);
+    }
+    bcache.nlive += BPP;
+    release(&bcache.evictlock);
+  }
 }
 
+// Is the cache running out of buffers that bget() can recycle?
+int
+bshort(void)
+{
+  int r;
 
+  acquire(&bcache.lrulock);
+  r = bcache.nlru < NBUF;
+  release(&bcache.lrulock);
+  return r;
+}
@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // release buf when the disk is done with it?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // LRU list of unreferenced buffers
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *hnext; // hash chain
+  struct buf *qnext; // next block in the same disk request
+  int logged;  // # of uncheckpointed transactions with this block (log.c)
+  uchar *data; // BSIZE bytes in a page shared with other bufs
 };
 
@@ -0,0 +1,188 @@
+// Directory entry cache.
+//
+// Remembers the result of dirlookup(): for a directory (by
+// device and inode number) and a name, the inode number the
+// name refers to and the offset of its dirent, or that the
+// name isn't there ("negative" entry, inum == 0). Path walks
+// that look up the same names again then don't read the
+// directory.
+//
+// The cache must agree with the directories on disk, so
+// whoever changes a dirent updates the cache too: dirlink()
+// enters the new name, unlink makes it negative, and iput()
+// purges a directory's entries when it frees the directory.
+// Lookups and updates happen with the directory's inode
+// locked, so they can't race with each other.
+//
+// dcache.lock protects the hash chains, the LRU list, and
+// all dentry fields.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDHASH 127
+
+struct dentry {
+  uint dev;
+  uint dinum;          // directory's inode number; 0 if unused
+  char name[DIRSIZ];
+  uint inum;           // 0 if name is not in the directory
+  uint off;            // offset of the dirent, if inum != 0
+  struct dentry *hnext;  // hash chain
+  struct dentry *prev;   // LRU list, most recently used at lru.prev
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *hash[NDHASH];
+  struct dentry lru;
+} dcache;
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// Move d to the most-recently-used end of the LRU list.
+static void
+dtouch(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->prev = dcache.lru.prev;
+  d->next = &dcache.lru;
+  dcache.lru.prev->next = d;
+  dcache.lru.prev = d;
+}
+
+// Take d out of its hash chain and mark it unused.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)];
+  for(; *pp; pp = &(*pp)->hnext){
+    if(*pp == d){
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->hnext = 0;
+  d->dinum = 0;
+}
+
+// Caller must hold dcache.lock.
+static struct dentry*
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dinum, name)]; d; d = d->hnext)
+    if(d->dev == dev && d->dinum == dinum && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+void
+dcacheinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.prev = &dcache.lru;
+  dcache.lru.next = &dcache.lru;
+  for(d = dcache.dentry; d < dcache.dentry + NDENTRY; d++){
+    d->prev = dcache.lru.prev;
+    d->next = &dcache.lru;
+    dcache.lru.prev->next = d;
+    dcache.lru.prev = d;
+  }
+}
+
+// Look up name in directory dp. Returns 0 if the cache
+// doesn't know, and otherwise 1, with the inode number in
+// *inum (0 if there is no such name) and the dirent's
+// offset in *off.
+// Caller must hold dp->lock.
+int
+dcache_lookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  *inum = d->inum;
+  *off = d->off;
+  dtouch(d);
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp refers to inode inum,
+// with its dirent at offset off, or, if inum is 0, that
+// there is no such name.
+// Caller must hold dp->lock.
+void
+dcache_enter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    // Recycle the least recently used entry.
+    d = dcache.lru.next;
+    if(d->dinum != 0)
+      dunhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dinum, d->name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory dinum on dev, which
+// is being freed and may come back as another directory.
+void
+dcache_purge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry + NDENTRY; d++){
+    if(d->dinum == dinum && d->dev == dev){
+      dunhash(d);
+      // first in line for reuse.
+      d->next->prev = d->prev;
+      d->prev->next = d->next;
+      d->next = dcache.lru.next;
+      d->prev = &dcache.lru;
+      dcache.lru.next->prev = d;
+      dcache.lru.next = d;
+    }
+  }
+  release(&dcache.lock);
+}
@@ -12,10 +12,29 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_async(uint, uint);
+void            breadahead(uint, uint*, int);
+struct buf*     bnew(uint, uint);
+int             bcached(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwritev(struct buf**, int);
+void            bflush(struct buf**, int);
+void            bwait_poll(struct buf*);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+void            bgrow(void);
+int             bshort(void);
+
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(struct inode*, char*, uint*, uint*);
+void            dcache_enter(struct inode*, char*, uint, uint);
+void            dcache_purge(uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -25,6 +44,18 @@ void            consputc(int);
 // exec.c
 int             exec(char*, char**);
 
+// fat.c
+void            fatinit(void);
+int             fatmount(struct inode*);
+int             fatumount(struct inode*);
+void            fatput(struct inode*);
+struct inode*   fatlookup(struct inode*, char*);
+struct inode*   fatcreate(struct inode*, char*, short);
+int             fatunlink(struct inode*, char*);
+int             fatread(struct inode*, int, uint64, uint, uint);
+int             fatwrite(struct inode*, int, uint64, uint, uint);
+void            fattrunc(struct inode*);
+
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
@@ -33,28 +64,35 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filecopy(struct file*, uint*, struct file*, uint*, int);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
+int             irefs(struct inode*);
 struct inode*   iget(uint dev, uint inum);
+struct inode*   inew(uint dev);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             directi(struct inode*, int, uint64, uint, uint);
 int             namecmp(const char*, const char*);
 struct inode*   namefd(int fd, int nameiparent, char *path);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             pshrink(int);
+char*           pget(struct inode*, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -64,13 +102,28 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kdup(void *);
 void            kinit(void);
+uint64          kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+int             log_inplace(struct buf*);
+int             log_ordered(void);
+void            log_free(uint);
+int             log_freed(uint);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+int             log_unpin(void);
+
+// pcache.c
+void            pcacheinit(void);
+int             pcachefull(void);
+char*           pcache_lookup(struct inode*, uint);
+int             pcache_insert(struct inode*, uint, char*);
+int             pcache_drop(struct inode*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -92,6 +145,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             kthread(void (*)(void), char *);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -175,6 +229,9 @@ void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          kvmpa(uint64);
+uint64          uvmaddr(pagetable_t, uint64, int);
+uint64          uvmfault(pagetable_t, uint64, int);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -185,10 +242,24 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+uint64          vmabase(struct proc*);
+int             vmafault(pagetable_t, uint64, int);
+void            vmatouch(uint64, uint64, int);
+uint64          vmamap(uint64, uint64, int, int, struct file*, uint64);
+int             vmaunmaprange(uint64, uint64);
+void            vmaclear(struct proc*, pagetable_t);
+int             vmacopy(struct proc*, struct proc*);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr(void);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_poll(struct buf *);
+void            virtio_disk_raw(int, uint64, char *, uint64, int);
+int             virtio_disk_user(uint, pagetable_t, uint64, uint64, uint64, int);
+void            virtio_disk_intr(int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,515 @@
+// FAT file system, served in place from the sdcard.
+//
+// mount() puts the FAT volume on an xv6 directory, the mount
+// point, and from then on the FAT files under it look like
+// xv6 files to everything above fs.c: an inode whose ip->fat
+// is set is a FAT file, and readi(), writei(), dirlookup() &c.
+// hand it to the functions here, which call FatFs.
+//
+// A FAT inode has no inode number. It comes from inew(), so
+// iget() never finds it; instead each FAT file in use has a
+// struct fatfile, found by mount point and path, which points
+// at the one inode and FIL for that file. iput() calls fatput()
+// when the last reference goes. The mount point stays an
+// ordinary xv6 inode (held by the mount), with ip->fat pointing
+// at the FAT root.
+//
+// A directory's fatfile also keeps the FatFs DIR that
+// fatreaddir() last read from, so that reading a directory
+// from start to end reads it once.
+//
+// FatFs isn't reentrant, so fat.lock serializes all calls
+// into it. Inode locks come before fat.lock.
+//
+// FAT has no hard links, device files or xv6 inode numbers,
+// and only 8.3 names (FF_USE_LFN is 0).
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "stat.h"
+#include "fat32/ff.h"
+
+struct fatfile {
+  struct inode *mnt;   // mount point it was found under; 0 if free
+  char path[MAXPATH];  // from the FAT root; "" for the root
+  struct inode *ip;    // its inode; 0 for the root
+  uint pinum;          // root: inode number of the mount point's parent
+  int open;            // regular file: fil is open
+  FIL fil;
+  int diropen;         // directory: dir is open
+  uint dirnext;        // index of the dirent dir reads next
+  DIR dir;
+};
+
+struct {
+  struct sleeplock lock;
+  FATFS fs;
+  int nmount;          // mount points fs is mounted on
+  struct fatfile file[NFATFILE];
+} fat;
+
+// Caller must hold fat.lock.
+static struct fatfile*
+falloc(struct inode *mnt, char *path)
+{
+  struct fatfile *ff;
+
+  for(ff = fat.file; ff < fat.file + NFATFILE; ff++){
+    if(ff->mnt == 0){
+      ff->mnt = mnt;
+      safestrcpy(ff->path, path, MAXPATH);
+      ff->ip = 0;
+      ff->pinum = 0;
+      ff->open = 0;
+      ff->diropen = 0;
+      return ff;
+    }
+  }
+  return 0;
+}
+
+// Compare FAT paths; 8.3 names ignore case.
+static int
+pathcmp(char *p, char *q)
+{
+  char a, b;
+
+  for(;; p++, q++){
+    a = *p >= 'a' && *p <= 'z' ? *p - 'a' + 'A' : *p;
+    b = *q >= 'a' && *q <= 'z' ? *q - 'a' + 'A' : *q;
+    if(a != b || a == 0)
+      return a - b;
+  }
+}
+
+// The fatfile of the file at path under mount point mnt,
+// if it's in use. Caller must hold fat.lock.
+static struct fatfile*
+ffind(struct inode *mnt, char *path)
+{
+  struct fatfile *ff;
+
+  for(ff = fat.file; ff < fat.file + NFATFILE; ff++)
+    if(ff->mnt == mnt && ff->ip && pathcmp(ff->path, path) == 0)
+      return ff;
+  return 0;
+}
+
+// The FatFs path of name in directory d.
+static int
+fpath(char *buf, struct fatfile *d, char *name)
+{
+  int n, m;
+
+  n = strlen(d->path);
+  for(m = 0; m < DIRSIZ && name[m]; m++)
+    ;
+  if(n + 1 + m >= MAXPATH)
+    return -1;
+  memmove(buf, d->path, n);
+  buf[n] = '/';
+  memmove(buf + n + 1, name, m);
+  buf[n + 1 + m] = 0;
+  return 0;
+}
+
+// Return the inode for the file or directory at path, found
+// under mount point mnt, making one if it isn't in use.
+// Returns 0 if there is none.
+// Caller must hold fat.lock.
+static struct inode*
+fatget(struct inode *mnt, char *path)
+{
+  FILINFO fno;
+  struct fatfile *ff;
+  struct inode *ip;
+
+  if((ff = ffind(mnt, path)) != 0)
+    return idup(ff->ip);
+  if(f_stat(path, &fno) != FR_OK || (ff = falloc(mnt, path)) == 0)
+    return 0;
+  if((fno.fattrib & AM_DIR) == 0){
+    if(f_open(&ff->fil, path, FA_READ|FA_WRITE) != FR_OK &&
+       f_open(&ff->fil, path, FA_READ) != FR_OK){
+      ff->mnt = 0;
+      return 0;
+    }
+    ff->open = 1;
+  }
+
+  ip = inew(SDDEV);
+  ff->ip = ip;
+  ip->fat = ff;
+  ip->type = (fno.fattrib & AM_DIR) ? T_DIR : T_FILE;
+  ip->major = ip->minor = 0;
+  ip->nlink = 1;
+  ip->size = (fno.fattrib & AM_DIR) ? 0 : fno.fsize;
+  return ip;
+}
+
+// Called by forkret(): mount the sdcard on /sdcard.
+void
+fatinit(void)
+{
+  struct inode *ip;
+
+  initsleeplock(&fat.lock, "fat");
+
+  begin_opn(CREATEBLOCKS);
+  if((ip = namei("/sdcard")) != 0)
+    ilock(ip);
+  else
+    ip = create("/sdcard", T_DIR, 0, 0);
+  if(ip == 0 || ip->type != T_DIR || fatmount(ip) < 0)
+    printf("fat: can't mount the sdcard on /sdcard\n");
+  if(ip)
+    iunlockput(ip);
+  end_op();
+}
+
+// Mount the FAT volume on directory dp, taking a reference
+// to dp for as long as it's mounted. Returns -1 if there is
+// no volume or dp is in use as a mount point.
+// Caller must hold dp->lock, inside a transaction.
+int
+fatmount(struct inode *dp)
+{
+  struct inode *pp;
+  struct fatfile *ff;
+  uint pinum;
+
+  if(dp->type != T_DIR || dp->fat)
+    return -1;
+  if((pp = dirlookup(dp, "..", 0)) == 0)
+    return -1;
+  pinum = pp->inum;
+  iput(pp);
+
+  acquiresleep(&fat.lock);
+  if(fat.nmount == 0 && f_mount(&fat.fs, "", 1) != FR_OK){
+    releasesleep(&fat.lock);
+    return -1;
+  }
+  if((ff = falloc(dp, "")) == 0){
+    if(fat.nmount == 0)
+      f_unmount("");
+    releasesleep(&fat.lock);
+    return -1;
+  }
+  ff->pinum = pinum;
+  fat.nmount++;
+  releasesleep(&fat.lock);
+
+  dp->fat = ff;
+  idup(dp);
+  return 0;
+}
+
+// Unmount the FAT volume from dp. Returns -1 if dp isn't a
+// mount point, or a FAT file under it is still in use.
+// On success the caller must iput() the mount's reference.
+// Caller must hold dp->lock.
+int
+fatumount(struct inode *dp)
+{
+  struct fatfile *ff;
+
+  if(dp->fat == 0 || dp->fat->mnt != dp)
+    return -1;
+
+  acquiresleep(&fat.lock);
+  for(ff = fat.file; ff < fat.file + NFATFILE; ff++){
+    if(ff->mnt == dp && ff != dp->fat){
+      releasesleep(&fat.lock);
+      return -1;
+    }
+  }
+  if(dp->fat->diropen)
+    f_closedir(&dp->fat->dir);
+  dp->fat->mnt = 0;
+  if(--fat.nmount == 0)
+    f_unmount("");
+  releasesleep(&fat.lock);
+
+  dp->fat = 0;
+  return 0;
+}
+
+// Let go of FAT inode ip, whose last reference is going away,
+// unless fatget() has handed it out again meanwhile.
+void
+fatput(struct inode *ip)
+{
+  struct fatfile *ff = ip->fat;
+
+  acquiresleep(&fat.lock);
+  if(irefs(ip) > 1){
+    releasesleep(&fat.lock);
+    return;
+  }
+  if(ff->open)
+    f_close(&ff->fil);
+  if(ff->diropen)
+    f_closedir(&ff->dir);
+  ff->open = 0;
+  ff->diropen = 0;
+  ff->ip = 0;
+  ff->mnt = 0;
+  releasesleep(&fat.lock);
+
+  ip->fat = 0;
+  ip->type = 0;
+  ip->valid = 0;
+}
+
+// Look up name in FAT directory dp, which may be a
+// mount point.
+// Caller must hold dp->lock.
+struct inode*
+fatlookup(struct inode *dp, char *name)
+{
+  struct fatfile *d = dp->fat;
+  struct inode *ip;
+  char path[MAXPATH];
+  int i;
+
+  if(namecmp(name, ".") == 0)
+    return idup(dp);
+
+  if(namecmp(name, "..") == 0){
+    if(d->path[0] == 0)
+      return iget(dp->dev, d->pinum);
+    safestrcpy(path, d->path, MAXPATH);
+    for(i = strlen(path); i > 0 && path[i] != '/'; i--)
+      ;
+    path[i] = 0;
+    if(i == 0)
+      return idup(d->mnt);
+  } else if(fpath(path, d, name) < 0){
+    return 0;
+  }
+
+  acquiresleep(&fat.lock);
+  ip = fatget(d->mnt, path);
+  releasesleep(&fat.lock);
+  return ip;
+}
+
+// Create a file or directory called name in FAT directory
+// dp, and return its inode, unlocked.
+// Caller must hold dp->lock.
+struct inode*
+fatcreate(struct inode *dp, char *name, short type)
+{
+  struct fatfile *ff;
+  struct inode *ip;
+  char path[MAXPATH];
+  FRESULT r;
+
+  if((type != T_FILE && type != T_DIR) || fpath(path, dp->fat, name) < 0)
+    return 0;
+
+  acquiresleep(&fat.lock);
+  if(type == T_DIR){
+    r = f_mkdir(path);
+  } else if((ff = falloc(dp->fat->mnt, path)) == 0){
+    r = FR_TOO_MANY_OPEN_FILES;
+  } else {
+    if((r = f_open(&ff->fil, path, FA_CREATE_NEW|FA_WRITE)) == FR_OK)
+      f_close(&ff->fil);
+    ff->mnt = 0;
+  }
+  ip = r == FR_OK ? fatget(dp->fat->mnt, path) : 0;
+  releasesleep(&fat.lock);
+  return ip;
+}
+
+// Remove name from FAT directory dp. Refuses, rather than
+// leave FatFs with a stale open file, if name is in use.
+// Caller must hold dp->lock.
+int
+fatunlink(struct inode *dp, char *name)
+{
+  struct fatfile *ff;
+  char path[MAXPATH];
+  FRESULT r;
+
+  if(fpath(path, dp->fat, name) < 0)
+    return -1;
+
+  acquiresleep(&fat.lock);
+  for(ff = fat.file; ff < fat.file + NFATFILE; ff++){
+    if(ff->mnt && pathcmp(ff->path, path) == 0){
+      releasesleep(&fat.lock);
+      return -1;
+    }
+  }
+  r = f_unlink(path);
+  releasesleep(&fat.lock);
+  return r == FR_OK ? 0 : -1;
+}
+
+// Read FAT directory ip as xv6 dirents, "." and ".." first.
+// Returns at most a page's worth. Carries on from where the
+// last call left d->dir, and only reopens it to go back.
+// Caller must hold ip->lock.
+static int
+fatreaddir(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  struct fatfile *d = ip->fat;
+  struct dirent de;
+  FILINFO fno;
+  char *buf;
+  uint i, tot, o, m;
+
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if((buf = kalloc()) == 0)
+    return -1;
+
+  // d->dir has read the dirents before d->dirnext; start it
+  // over only if off is before that.
+  acquiresleep(&fat.lock);
+  if(d->diropen && off < d->dirnext * sizeof(de)){
+    f_closedir(&d->dir);
+    d->diropen = 0;
+  }
+  if(!d->diropen){
+    if(f_opendir(&d->dir, d->path[0] ? d->path : "/") != FR_OK){
+      releasesleep(&fat.lock);
+      kfree(buf);
+      return -1;
+    }
+    d->diropen = 1;
+    d->dirnext = 2;
+  }
+  i = off / sizeof(de) < 2 ? 0 : d->dirnext;
+  for(tot = 0; tot < n; i++){
+    memset(&de, 0, sizeof(de));
+    if(i < 2){
+      safestrcpy(de.name, i == 0 ? "." : "..", DIRSIZ);
+    } else {
+      if(f_readdir(&d->dir, &fno) != FR_OK || fno.fname[0] == 0)
+        break;
+      if(strncmp(fno.fname, ".", DIRSIZ) == 0 || strncmp(fno.fname, "..", DIRSIZ) == 0){
+        i--;
+        continue;
+      }
+      d->dirnext = i + 1;
+      strncpy(de.name, fno.fname, DIRSIZ);
+    }
+    de.inum = i + 1;
+
+    // the part of this dirent that [off, off+n) covers.
+    if((i + 1) * sizeof(de) <= off)
+      continue;
+    o = off + tot - i * sizeof(de);
+    m = sizeof(de) - o;
+    if(m > n - tot)
+      m = n - tot;
+    memmove(buf + tot, (char*)&de + o, m);
+    tot += m;
+  }
+  releasesleep(&fat.lock);
+
+  if(either_copyout(user_dst, dst, buf, tot) < 0)
+    tot = -1;
+  kfree(buf);
+  return tot;
+}
+
+// Read data from FAT file or directory ip, like readi().
+// Caller must hold ip->lock.
+int
+fatread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  struct fatfile *ff = ip->fat;
+  char *buf;
+  UINT m, got;
+  int tot;
+
+  if(ip->type == T_DIR)
+    return fatreaddir(ip, user_dst, dst, off, n);
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+  if((buf = kalloc()) == 0)
+    return -1;
+
+  // a page at a time, copying out without fat.lock held,
+  // in case that faults in a page of a mapped file.
+  for(tot = 0; tot < n; tot += got){
+    m = n - tot < PGSIZE ? n - tot : PGSIZE;
+    acquiresleep(&fat.lock);
+    if(f_lseek(&ff->fil, off + tot) != FR_OK || f_read(&ff->fil, buf, m, &got) != FR_OK)
+      got = 0;
+    releasesleep(&fat.lock);
+    if(got == 0)
+      break;
+    if(either_copyout(user_dst, dst + tot, buf, got) < 0){
+      tot = -1;
+      break;
+    }
+  }
+  kfree(buf);
+  return tot;
+}
+
+// Write data to FAT file ip, like writei().
+// Caller must hold ip->lock.
+int
+fatwrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  struct fatfile *ff = ip->fat;
+  char *buf;
+  UINT m, got;
+  int tot;
+
+  if(ip->type != T_FILE || off > ip->size || off + n < off)
+    return -1;
+  if((buf = kalloc()) == 0)
+    return -1;
+
+  for(tot = 0; tot < n; tot += got){
+    m = n - tot < PGSIZE ? n - tot : PGSIZE;
+    if(either_copyin(buf, user_src, src + tot, m) < 0)
+      break;
+    acquiresleep(&fat.lock);
+    if(f_lseek(&ff->fil, off + tot) != FR_OK || f_write(&ff->fil, buf, m, &got) != FR_OK)
+      got = 0;
+    ip->size = f_size(&ff->fil);
+    releasesleep(&fat.lock);
+    if(got == 0)
+      break;
+  }
+  // write the new size into the directory entry.
+  acquiresleep(&fat.lock);
+  f_sync(&ff->fil);
+  releasesleep(&fat.lock);
+  kfree(buf);
+  return tot;
+}
+
+// Truncate FAT file ip to nothing.
+// Caller must hold ip->lock.
+void
+fattrunc(struct inode *ip)
+{
+  struct fatfile *ff = ip->fat;
+
+  if(ip->type != T_FILE)
+    return;
+  acquiresleep(&fat.lock);
+  if(f_lseek(&ff->fil, 0) == FR_OK && f_truncate(&ff->fil) == FR_OK)
+    ip->size = 0;
+  f_sync(&ff->fil);
+  releasesleep(&fat.lock);
+}
@@ -101,6 +101,37 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
   
+// Called before reading n bytes at f->off.
+// While f is read sequentially, grow its read-ahead
+// window and start reading the blocks in it.
+// Caller must hold f->ip->lock.
+static void
+fileahead(struct file *f, int n)
+{
+  uint first, last;
+
+  if(n <= 0)
+    return;
+  if(f->off != f->ranext){
+    // not sequential: stop reading ahead.
+    f->rawin = 0;
+    f->raend = 0;
+    return;
+  }
+  if(f->rawin == 0)
+    f->rawin = RAMIN;
+  else if(f->rawin < RAMAX)
+    f->rawin *= 2;
+
+  first = f->off / BSIZE;
+  last = (f->off + n - 1) / BSIZE + 1 + f->rawin;
+  if(first < f->raend)
+    first = f->raend;
+  if(first < last)
+    readahead(f->ip, first, last - first);
+  f->raend = last;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -111,6 +142,10 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // the copy below may happen with locks held, so it
+  // mustn't have to fault in mmap() pages itself.
+  vmatouch(addr, n, 1);
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -119,8 +154,15 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if(f->direct && f->off % BSIZE == 0 && n % BSIZE == 0){
+      r = directi(f->ip, 0, addr, f->off, n);
+    } else {
+      fileahead(f, n);
+      r = readi(f->ip, 1, addr, f->off, n);
+    }
+    if(r > 0)
       f->off += r;
+    f->ranext = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -139,6 +181,8 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  vmatouch(addr, n, 0);
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -146,22 +190,22 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // a few blocks at a time; see MAXOPBYTES.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
+      if(n1 > MAXOPBYTES)
+        n1 = MAXOPBYTES;
 
-      begin_op();
+      begin_opn(OPBLOCKS(n1));
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      if(f->direct && f->off % BSIZE == 0 && n1 % BSIZE == 0)
+        r = directi(f->ip, 1, addr + i, f->off, n1);
+      else
+        r = writei(f->ip, 1, addr + i, f->off, n1);
+      if(r > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
@@ -180,3 +224,93 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Copy up to n bytes from regular file in, starting at offset
+// *inoff, to file out, at offset *outoff if out is an inode,
+// without passing them through user space. Advances *inoff and
+// *outoff past what was copied. Each page comes from in's page
+// cache and is written to out with writei(), in ops as large as
+// a write() would use. The two inodes are never locked at once,
+// so in and out may be the same file.
+// Returns the number of bytes copied (0 at the end of in),
+// or -1 if nothing could be copied.
+int
+filecopy(struct file *in, uint *inoff, struct file *out, uint *outoff, int n)
+{
+  struct inode *ip = in->ip;
+  int tot, m, r, n1, done, err;
+  char *pg;
+  uint o;
+
+  if(!in->readable || !out->writable || in->type != FD_INODE || ip->type != T_FILE)
+    return -1;
+  if(out->type == FD_DEVICE){
+    if(out->major < 0 || out->major >= NDEV || !devsw[out->major].write)
+      return -1;
+  } else if(out->type != FD_INODE || out->ip->type != T_FILE){
+    return -1;
+  }
+
+  tot = 0;
+  done = err = 0;
+  while(tot < n && !done){
+    n1 = n - tot;
+    if(n1 > MAXOPBYTES)
+      n1 = MAXOPBYTES;
+    if(out->type == FD_INODE)
+      begin_opn(OPBLOCKS(n1));
+    while(n1 > 0){
+      ilock(ip);
+      o = *inoff;
+      if(o >= ip->size){
+        iunlock(ip);
+        done = 1;
+        break;
+      }
+      if(tot == 0 || o % (RAMAX*BSIZE) == 0)
+        readahead(ip, o / BSIZE, RAMAX);
+      m = ip->size - o;
+      if(m > PGSIZE - o % PGSIZE)
+        m = PGSIZE - o % PGSIZE;
+      if(m > n1)
+        m = n1;
+      // take a reference to the page, so that it can't go
+      // away once in is unlocked. a FAT file isn't in the
+      // page cache: read it into a page of our own.
+      if(ip->fat){
+        if((pg = kalloc()) != 0 && readi(ip, 0, (uint64)pg + o % PGSIZE, o, m) != m){
+          kfree(pg);
+          pg = 0;
+        }
+      } else if((pg = pget(ip, o / PGSIZE)) != 0){
+        kdup(pg);
+      }
+      iunlock(ip);
+      if(pg == 0){
+        done = err = 1;
+        break;
+      }
+
+      if(out->type == FD_DEVICE){
+        r = devsw[out->major].write(0, (uint64)pg + o % PGSIZE, m);
+      } else {
+        ilock(out->ip);
+        if((r = writei(out->ip, 0, (uint64)pg + o % PGSIZE, *outoff, m)) > 0)
+          *outoff += r;
+        iunlock(out->ip);
+      }
+      kfree(pg);
+      if(r > 0){
+        *inoff += r;
+        tot += r;
+        n1 -= r;
+      }
+      if(r != m){
+        done = err = 1;
+        break;
+      }
+    }
+    if(out->type == FD_INODE)
+      end_op();
+  }
+  return tot == 0 && err ? -1 : tot;
+}
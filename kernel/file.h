@@ -6,6 +6,10 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint ranext;       // FD_INODE: offset at which a sequential read continues
+  uint rawin;        // FD_INODE: read-ahead window, in blocks
+  uint raend;        // FD_INODE: first block not yet read ahead
+  char direct;       // FD_INODE: opened with O_DIRECT
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +22,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // hash chain
+  struct inode *prev; // LRU list of unreferenced inodes
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +33,16 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint eindex;
+
+  uint cfbn;          // the extent bmap() used last,
+  struct extent cext; // which starts at file block cfbn
+
+  void **pages;       // radix tree of cached pages; see pcache.c
+  int pdepth;         // levels in the tree
+
+  struct fatfile *fat; // FAT file, or FAT root mounted here; see fat.c
 };
 
 // map major device number to device functions.
@@ -37,4 +53,24 @@ struct devsw {
 
 extern struct devsw devsw[];
 
+// write many blocks in one op, but not so many that one op
+// takes more than half of a log transaction. an op writing
+// n bytes reserves OPBLOCKS(n): the data blocks, 2 blocks of
+// slop for non-aligned writes, i-node, extent index and 2
+// leaves, and 2 allocation blocks.
+#define MAXOPBYTES  ((LOGSIZE/2 - 2-1-3-2) * BSIZE)
+#define OPBLOCKS(n) ((n)/BSIZE + 2+1+3+2)
+
+// adding a name to a directory may write: for turning a linear
+// directory into an indexed one, 4 buckets, the index block, a
+// bitmap block for each of 3 new blocks, extent index and 2
+// leaves, and the i-node; then for splitting the name's bucket
+// until it has room, at most log2(NDIRINDEX) = 8 times, the old
+// bucket, a new bucket and a bitmap block per split, the index,
+// extent index and 2 leaves, and the i-node.
+#define DIRLINKBLOCKS ((4+1+3+3+1) + (1+8*2+1+3+1))
+// creating a file adds the new i-node's block, and for a
+// directory the first block of "." and ".." and its bitmap block.
+#define CREATEBLOCKS  (1+2 + DIRLINKBLOCKS)
+
 #define CONSOLE 1
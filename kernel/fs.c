@@ -26,6 +26,10 @@
 // only one device
 struct superblock sb; 
 
+static uint dindex(struct inode*);
+static void groupinit(int);
+static void imapinit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +48,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  groupinit(dev);
+  imapinit(dev);
 }
 
 // Zero a block.
@@ -52,34 +58,163 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// The disk is divided into allocation groups, each with its own
+// inode blocks and free map block (see fs.h), so that CPUs that
+// allocate in different groups don't wait for each other's buffers.
+// balloc() and ialloc() start in the calling CPU's group unless
+// they have a hint. For each group the kernel keeps in memory the
+// number of free blocks, so that balloc() needn't read full free
+// maps, and a cursor, after the block balloc() last found by
+// searching, where the next search in the group starts. Allocation
+// and freeing update them with the free map block locked.
+
+struct agroup {
+  struct spinlock lock;  // protects the fields below, and the
+                         // group's bits in imap.free
+  uint nfree;
+  uint cursor;           // block number
+};
+static struct agroup *group;  // a kalloc()ed page
+
+// First block after group g.
+static uint
+gend(uint g)
+{
+  uint e = GBASE(g, sb) + sb.gsize;
+
+  return e < sb.size ? e : sb.size;
+}
+
+// The calling CPU's allocation group.
+static uint
+cpugroup(void)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return id % sb.ngroups;
+}
+
+static void
+groupinit(int dev)
+{
+  struct buf *bp;
+  uint g, bi;
+
+  if(sb.ngroups == 0 || sb.ngroups > PGSIZE / sizeof(struct agroup) ||
+     sb.gsize > BPB || sb.ginodes % 64 != 0 || sb.ginodes % IPB != 0)
+    panic("groupinit: bad groups");
+  // freeing a file's blocks in unlink or the last close writes a
+  // bitmap block per group, extent index and 2 leaves, the i-node,
+  // and the directory block, inside a plain begin_op().
+  if(sb.ngroups + 3+1+1 > MAXOPBLOCKS)
+    panic("groupinit: too many groups for MAXOPBLOCKS");
+  if((group = kalloc()) == 0)
+    panic("groupinit: kalloc");
+  for(g = 0; g < sb.ngroups; g++){
+    initlock(&group[g].lock, "agroup");
+    group[g].cursor = GBASE(g, sb);
+    group[g].nfree = 0;
+    bp = bread(dev, GBMAP(g, sb));
+    for(bi = 0; bi < gend(g) - GBASE(g, sb); bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        group[g].nfree++;
+    brelse(bp);
+  }
+}
 
-// Allocate a zeroed disk block.
+// Look in bp, the free map block of group g, for a free
+// block at or after block from. Skips full words 64 blocks
+// at a time. Returns the block, or 0.
+static uint
+bscan(struct buf *bp, uint g, uint from)
+{
+  uint64 *w = (uint64*)bp->data;
+  uint bi, end, base;
+
+  base = GBASE(g, sb);
+  end = gend(g) - base;
+  for(bi = from - base; bi < end; bi++){
+    if(bi % 64 == 0){
+      while(bi < end && w[bi/64] == ~0ULL)
+        bi += 64;
+      if(bi >= end)
+        break;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0 && !log_freed(base + bi))
+      return base + bi;
+  }
+  return 0;
+}
+
+// Mark free block x in bp, the free map block of group g,
+// in use, and release bp.
+static uint
+btake(struct buf *bp, uint g, uint x)
+{
+  uint bi = BBIT(x, sb);
+
+  bp->data[bi/8] |= 1 << (bi % 8);
+  log_write(bp);
+  acquire(&group[g].lock);
+  group[g].nfree--;
+  release(&group[g].lock);
+  brelse(bp);
+  return x;
+}
+
+// Allocate a disk block: the first free one at or after goal,
+// for example the block after a file's last one, if goal's
+// group has one, and otherwise the first one after the cursor
+// of the calling CPU's group, or failing that of the groups
+// after it. The caller must initialize it:
+// bzero() for metadata, writei() clears new data blocks itself.
+// Blocks freed by transactions that have not yet committed are
+// not handed out again, since a crash could bring back the file
+// that had them after writei() wrote new data in place.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  uint i, g, x, from, nfree;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal >= sb.gstart && goal < sb.size){
+    g = BGROUP(goal, sb);
+    bp = bread(dev, GBMAP(g, sb));
+    if((x = bscan(bp, g, goal)) != 0)
+      return btake(bp, g, x);
+    brelse(bp);
+  }
+
+  // Visit every group, starting and ending with the
+  // CPU's; the first time from its cursor on.
+  g = cpugroup();
+  acquire(&group[g].lock);
+  from = group[g].cursor;
+  release(&group[g].lock);
+  for(i = 0; i <= sb.ngroups; i++, g = (g + 1) % sb.ngroups, from = GBASE(g, sb)){
+    acquire(&group[g].lock);
+    nfree = group[g].nfree;
+    release(&group[g].lock);
+    if(nfree == 0)
+      continue;
+    bp = bread(dev, GBMAP(g, sb));
+    if((x = bscan(bp, g, from)) != 0){
+      acquire(&group[g].lock);
+      group[g].cursor = x + 1;
+      release(&group[g].lock);
+      return btake(bp, g, x);
     }
     brelse(bp);
   }
@@ -95,13 +230,17 @@ bfree(int dev, uint b)
   int bi, m;
 
   bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
+  bi = BBIT(b, sb);
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&group[BGROUP(b, sb)].lock);
+  group[BGROUP(b, sb)].nfree++;
+  release(&group[BGROUP(b, sb)].lock);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -111,15 +250,17 @@ bfree(int dev, uint b)
 // its size, the number of links referring to it, and the
 // list of blocks holding the file's content.
 //
-// The inodes are laid out sequentially on disk at block
-// sb.inodestart. Each inode has a number, indicating its
-// position on the disk.
+// The inodes are laid out sequentially on disk, in the
+// inode blocks of each allocation group in turn. Each inode
+// has a number, indicating its position on the disk.
 //
-// The kernel keeps a table of in-use inodes in memory
+// The kernel keeps a cache of inodes in memory
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The in-memory
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->valid.
+// iinit() sizes the cache from free memory, one ICACHEFRAC'th
+// of it, and iget() finds entries through a hash table.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -130,17 +271,20 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   is unused if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. An unused entry keeps its inode, on an
+//   LRU list, until iget() recycles it for another one, so
+//   a file that is opened again needn't be read again.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid, while iget() clears
+//   ip->valid when it recycles the entry, and iput() when
+//   it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -165,58 +309,194 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries, the hash chains and the LRU list. Since ip->ref
+// indicates whether an entry is in use, and ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold itable.lock
+// while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 127  // prime, like the buffer cache's NBUCKET
+
+#define IPP (PGSIZE / sizeof(struct inode))  // inodes per page
+#define NIPAGE (PGSIZE / sizeof(struct inode *))
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode **page;  // page of pointers to inode pages
+  int ninode;
+  struct inode *hash[NIHASH];  // chains through inode.hnext
+
+  // Doubly-linked list of inodes with ref == 0, through
+  // prev/next. lru.next is least recently used.
+  struct inode lru;
 } itable;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIHASH;
+}
+
+// Append ip to the most-recently-used end of the LRU list.
+static void
+ilru_push(struct inode *ip)
+{
+  ip->prev = itable.lru.prev;
+  ip->next = &itable.lru;
+  itable.lru.prev->next = ip;
+  itable.lru.prev = ip;
+}
+
+static void
+ilru_remove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  ip->next = ip->prev = 0;
+}
+
+// Is ip a file of the FAT volume, rather than of this disk?
+// A mount point has ip->fat set too, but is an xv6 inode.
+static int
+isfat(struct inode *ip)
+{
+  return ip->fat && ip->inum == 0;
+}
+
 void
 iinit()
 {
-  int i = 0;
+  struct inode *ip;
+  int i, n;
   
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.lru.prev = &itable.lru;
+  itable.lru.next = &itable.lru;
+
+  // One ICACHEFRAC'th of free memory, but at least NINODE and
+  // at most what one page of inode-page pointers can describe.
+  n = kfreepages() / ICACHEFRAC * IPP;
+  if(n < NINODE)
+    n = NINODE;
+  if(n > NIPAGE * IPP)
+    n = NIPAGE * IPP;
+
+  if((itable.page = kalloc()) == 0)
+    panic("iinit: kalloc");
+  memset(itable.page, 0, PGSIZE);
+  for(i = 0; i < n; i++){
+    if(i % IPP == 0 && (itable.page[i / IPP] = kalloc()) == 0)
+      break;
+    ip = &itable.page[i / IPP][i % IPP];
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    ilru_push(ip);
+    itable.ninode = i + 1;
   }
+  if(itable.ninode < NINODE)
+    panic("iinit: too few inodes");
 }
 
+// imap is a bitmap of the free inodes, kept in memory: fsinit()
+// builds it from the inode blocks, ialloc() and iput() keep it
+// up to date. A set bit is a free inode. Each group's lock
+// protects the group's bits, whole words since sb.ginodes
+// is a multiple of 64.
 
-// Allocate an inode on device dev.
-// Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode,
-// or NULL if there is no free inode.
-struct inode*
-ialloc(uint dev, short type)
+struct {
+  uint64 *free;  // a kalloc()ed page
+} imap;
+
+static void
+imapinit(int dev)
 {
-  int inum;
   struct buf *bp;
   struct dinode *dip;
+  uint inum;
 
+  if(sb.ninodes > PGSIZE * 8)
+    panic("imapinit: too many inodes");
+  if((imap.free = kalloc()) == 0)
+    panic("imapinit: kalloc");
+  memset(imap.free, 0, PGSIZE);
+  bp = 0;
   for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+    if(bp == 0 || inum % IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
     }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0)
+      imap.free[inum/64] |= 1ULL << (inum % 64);
+  }
+  if(bp)
     brelse(bp);
+}
+
+// Take a free inode from imap: the first at or after the first
+// one in near's inode block if near is in the calling CPU's
+// group, and otherwise from the start of that group, going on
+// to the groups after it. Returns 0 if none.
+static uint
+imaptake(uint near)
+{
+  uint i, w, n, nw, g;
+
+  nw = sb.ninodes / 64;
+  g = cpugroup();
+  if(near < sb.ninodes && IGROUP(near, sb) == g)
+    w = (near - near % IPB) / 64;
+  else
+    w = g * sb.ginodes / 64;
+  for(n = 0; n < nw; n++, w = (w + 1) % nw){
+    g = w * 64 / sb.ginodes;
+    acquire(&group[g].lock);
+    if(imap.free[w] == 0){
+      release(&group[g].lock);
+      continue;
+    }
+    for(i = 0; (imap.free[w] & (1ULL << i)) == 0; i++)
+      ;
+    imap.free[w] &= ~(1ULL << i);
+    release(&group[g].lock);
+    return w*64 + i;
   }
-  printf("ialloc: no inodes\n");
   return 0;
 }
 
+// Allocate an inode on device dev, in the calling CPU's
+// allocation group, and if possible in the same inode block as
+// inode near, for example the new inode's directory, so that a
+// directory and its files share inode blocks in the cache.
+// Mark it as allocated by  giving it type type.
+// Returns an unlocked but allocated and referenced inode,
+// or NULL if there is no free inode.
+struct inode*
+ialloc(uint dev, short type, uint near)
+{
+  uint inum;
+  struct buf *bp;
+  struct dinode *dip;
+
+  if((inum = imaptake(near)) == 0){
+    printf("ialloc: no inodes\n");
+    return 0;
+  }
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: imap");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
 // that lives on disk.
@@ -227,6 +507,8 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
+  if(isfat(ip))
+    return;
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
@@ -234,47 +516,85 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->eindex = ip->eindex;
   log_write(bp);
   brelse(bp);
 }
 
+// Take the least recently used unreferenced entry out of
+// the table, for reuse. Caller must hold itable.lock.
+static struct inode*
+irecycle(void)
+{
+  struct inode *ip, **pp;
+
+  ip = itable.lru.next;
+  if(ip == &itable.lru)
+    panic("iget: no inodes");
+  ilru_remove(ip);
+  if(ip->inum != 0){
+    for(pp = &itable.hash[ihash(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
+  pcache_drop(ip);
+  return ip;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  uint h = ihash(dev, inum);
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.hash[h]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        ilru_remove(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = irecycle();
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
 }
 
+// Return a new in-memory inode on device dev that no inode
+// number refers to, for a file of the FAT volume (see fat.c).
+// It's marked valid; the caller fills it in. iget() never
+// finds it, and it's let go of when the last reference is.
+struct inode*
+inew(uint dev)
+{
+  struct inode *ip;
+
+  acquire(&itable.lock);
+  ip = irecycle();
+  ip->dev = dev;
+  ip->inum = 0;
+  ip->ref = 1;
+  ip->valid = 1;
+  ip->hnext = 0;
+  release(&itable.lock);
+  return ip;
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
@@ -286,6 +606,18 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Return the number of references to ip.
+int
+irefs(struct inode *ip)
+{
+  int n;
+
+  acquire(&itable.lock);
+  n = ip->ref;
+  release(&itable.lock);
+  return n;
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -307,7 +639,9 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->eindex = dip->eindex;
+    ip->cext.len = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -326,8 +660,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry
+// goes on the LRU list, to be recycled when iget() needs it.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -337,6 +671,14 @@ iput(struct inode *ip)
 {
   acquire(&itable.lock);
 
+  if(ip->ref == 1 && isfat(ip)){
+    // last reference to a FAT file: close it, unless a
+    // FAT lookup finds ip again before fatput() can.
+    release(&itable.lock);
+    fatput(ip);
+    acquire(&itable.lock);
+  }
+
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
 
@@ -346,17 +688,23 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    acquire(&group[IGROUP(ip->inum, sb)].lock);
+    imap.free[ip->inum/64] |= 1ULL << (ip->inum % 64);
+    release(&group[IGROUP(ip->inum, sb)].lock);
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    ilru_push(ip);
   release(&itable.lock);
 }
 
@@ -371,52 +719,150 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, which the inode lists as extents.
+// The first NEXTENT are in ip->ext[]. After them come the
+// extents in the leaf blocks that the index block ip->eindex
+// lists, each with the file block its first extent starts at.
+// ip->cext remembers the extent bmap() found last, so that
+// sequential reads and writes needn't look again.
+
+// Remember extent e, which starts at file block fbn, in ip,
+// and return the address of file block bn in it.
+static uint
+ecache(struct inode *ip, uint fbn, struct extent *e, uint bn)
+{
+  ip->cfbn = fbn;
+  ip->cext = *e;
+  return e->start + bn - fbn;
+}
+
+// Append block addr to the list of n extents e, growing the
+// last one if addr follows it. Returns 0 if e is full.
+static int
+eappend(struct extent *e, int n, uint addr)
+{
+  int i;
+
+  for(i = 0; i < n && e[i].len; i++)
+    ;
+  if(i > 0 && e[i-1].start + e[i-1].len == addr){
+    e[i-1].len++;
+    return 1;
+  }
+  if(i == n)
+    return 0;
+  e[i].start = addr;
+  e[i].len = 1;
+  return 1;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, next to the
+// file's last block if it can; bn must then be the first block
+// past the ones ip has.
 // returns 0 if out of disk space.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  struct buf *ib, *lb;
+  struct eindex *x;
+  struct extent *e;
+  uint fbn, addr, goal, leaf;
+  int i, k;
+
+  if(ip->cext.len && bn >= ip->cfbn && bn < ip->cfbn + ip->cext.len)
+    return ip->cext.start + bn - ip->cfbn;
+
+  fbn = goal = addr = 0;
+  for(i = 0; i < NEXTENT && ip->ext[i].len; i++){
+    if(bn < fbn + ip->ext[i].len)
+      return ecache(ip, fbn, &ip->ext[i], bn);
+    fbn += ip->ext[i].len;
+    goal = ip->ext[i].start + ip->ext[i].len;
+  }
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
+  if(ip->eindex == 0){
+    if(bn != fbn)
+      panic("bmap: hole");
+    if((addr = balloc(ip->dev, goal)) == 0)
+      return 0;
+    if(eappend(ip->ext, NEXTENT, addr))
+      return addr;
+    // no room in the inode; start an index.
+    if((ip->eindex = balloc(ip->dev, 0)) == 0){
+      bfree(ip->dev, addr);
+      return 0;
     }
-    return addr;
+    bzero(ip->dev, ip->eindex);
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
+  // the last leaf starting at or before bn.
+  ib = bread(ip->dev, ip->eindex);
+  x = (struct eindex*)ib->data;
+  for(k = 0; k < NEINDEX && x[k].leaf && x[k].fbn <= bn; k++)
+    ;
+  lb = 0;
+  e = 0;
+  if(k > 0){
+    lb = bread(ip->dev, x[k-1].leaf);
+    e = (struct extent*)lb->data;
+    fbn = x[k-1].fbn;
+    for(i = 0; i < NLEAFEXT && e[i].len; i++){
+      if(bn < fbn + e[i].len){
+        addr = ecache(ip, fbn, &e[i], bn);
+        brelse(lb);
+        brelse(ib);
+        return addr;
       }
+      fbn += e[i].len;
+      goal = e[i].start + e[i].len;
     }
-    brelse(bp);
-    return addr;
   }
 
-  panic("bmap: out of range");
+  // bn is past the end.
+  if(bn != fbn)
+    panic("bmap: hole");
+  if(addr == 0 && (addr = balloc(ip->dev, goal)) == 0)
+    goto out;
+  if(lb && eappend(e, NLEAFEXT, addr)){
+    log_write(lb);
+    goto out;
+  }
+  // add a leaf.
+  if(k == NEINDEX || (leaf = balloc(ip->dev, 0)) == 0){
+    bfree(ip->dev, addr);
+    addr = 0;
+    goto out;
+  }
+  if(lb)
+    brelse(lb);
+  lb = bnew(ip->dev, leaf);
+  memset(lb->data, 0, BSIZE);
+  e = (struct extent*)lb->data;
+  e[0].start = addr;
+  e[0].len = 1;
+  log_write(lb);
+  x[k].fbn = bn;
+  x[k].leaf = leaf;
+  log_write(ib);
+
+out:
+  if(lb)
+    brelse(lb);
+  brelse(ib);
+  return addr;
+}
+
+// Free the blocks of the n extents e.
+static void
+efree(int dev, struct extent *e, int n)
+{
+  int i;
+  uint j;
+
+  for(i = 0; i < n && e[i].len; i++)
+    for(j = 0; j < e[i].len; j++)
+      bfree(dev, e[i].start + j);
 }
 
 // Truncate inode (discard contents).
@@ -424,27 +870,36 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int k;
+  struct buf *ib, *lb;
+  struct eindex *x;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+  if(isfat(ip)){
+    fattrunc(ip);
+    return;
+  }
+  pcache_drop(ip);
+  efree(ip->dev, ip->ext, NEXTENT);
+  memset(ip->ext, 0, sizeof(ip->ext));
+
+  if(ip->eindex){
+    ib = bread(ip->dev, ip->eindex);
+    x = (struct eindex*)ib->data;
+    for(k = 0; k < NEINDEX && x[k].leaf; k++){
+      lb = bread(ip->dev, x[k].leaf);
+      efree(ip->dev, (struct extent*)lb->data, NLEAFEXT);
+      brelse(lb);
+      bfree(ip->dev, x[k].leaf);
     }
+    brelse(ib);
+    bfree(ip->dev, ip->eindex);
+    ip->eindex = 0;
   }
+  ip->cext.len = 0;
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  if(ip->type == T_DIR && dindex(ip)){
+    bfree(ip->dev, dindex(ip));
+    ip->major = ip->minor = 0;
   }
 
   ip->size = 0;
@@ -463,6 +918,111 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Return the cached page holding page pn of regular file ip,
+// reading it in through the buffer cache if it isn't cached.
+// Bytes past the end of the file read as zero. Returns 0 if
+// pn is past the end of the file or memory is short.
+// Caller must hold ip->lock.
+char*
+pget(struct inode *ip, uint pn)
+{
+  uint addr[PGSIZE/BSIZE], bn, nb, i;
+  struct buf *bp;
+  char *pg;
+
+  if((pg = pcache_lookup(ip, pn)) != 0)
+    return pg;
+  if(pn >= (ip->size + PGSIZE - 1) / PGSIZE)
+    return 0;
+  // at the limit, let go of an unused file's pages, or if
+  // every cached file is in use, of this file's own.
+  if(pcachefull() && pshrink(1) == 0)
+    pcache_drop(ip);
+  if((pg = kalloc()) == 0)
+    return 0;
+  bn = pn * (PGSIZE/BSIZE);
+  nb = min(PGSIZE/BSIZE, (ip->size + BSIZE - 1)/BSIZE - bn);
+  for(i = 0; i < nb; i++){
+    if((addr[i] = bmap(ip, bn + i)) == 0){
+      kfree(pg);
+      return 0;
+    }
+  }
+  breadahead(ip->dev, addr, nb);
+  for(i = 0; i < nb; i++){
+    bp = bread(ip->dev, addr[i]);
+    memmove(pg + i*BSIZE, bp->data, BSIZE);
+    brelse(bp);
+  }
+  if(ip->size < (pn + 1) * PGSIZE)
+    memset(pg + ip->size % PGSIZE, 0, PGSIZE - ip->size % PGSIZE);
+  if(pcache_insert(ip, pn, pg) < 0){
+    kfree(pg);
+    return 0;
+  }
+  return pg;
+}
+
+// Called by kalloc() when memory is short: drop the cached
+// pages of inodes that nobody uses, least recently used first,
+// until about n pages have been let go of. Returns how many were.
+int
+pshrink(int n)
+{
+  struct inode *ip;
+  int m;
+
+  m = 0;
+  acquire(&itable.lock);
+  for(ip = itable.lru.next; ip != &itable.lru && m < n; ip = ip->next)
+    m += pcache_drop(ip);
+  release(&itable.lock);
+  return m;
+}
+
+// The user page that readi() or writei() last copied to or
+// from, so that a transfer of many blocks looks up each page
+// of the user's buffer once rather than once per block.
+struct upage {
+  uint64 va;   // page-aligned user address; 1 if none yet
+  char *pa;    // what it maps to
+};
+
+// Copy n bytes between kernel address k and address a, which
+// is a user address if user is set: out to a if out is set,
+// otherwise in from a. Returns 0 on success, -1 on error.
+static int
+ucopy(struct upage *u, int user, uint64 a, char *k, uint n, int out)
+{
+  uint64 va0;
+  uint m;
+
+  if(!user){
+    if(out)
+      memmove((char*)a, k, n);
+    else
+      memmove(k, (char*)a, n);
+    return 0;
+  }
+  while(n > 0){
+    va0 = PGROUNDDOWN(a);
+    if(va0 != u->va){
+      if((u->pa = (char*)uvmfault(myproc()->pagetable, va0, out)) == 0)
+        return -1;
+      u->va = va0;
+    }
+    m = min(n, PGSIZE - (a - va0));
+    if(out)
+      memmove(u->pa + (a - va0), k, m);
+    else
+      memmove(k, u->pa + (a - va0), m);
+    n -= m;
+    a += m;
+    k += m;
+  }
+  return 0;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -472,19 +1032,32 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  struct upage u = { 1, 0 };
+  char *pg;
 
+  if(ip->fat)
+    return fatread(ip, user_dst, dst, off, n);
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(ip->type == T_FILE && (pg = pget(ip, off/PGSIZE)) != 0){
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      if(ucopy(&u, user_dst, dst, pg + off%PGSIZE, m, 1) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    // out of memory for the page cache.
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    if(ucopy(&u, user_dst, dst, (char*)bp->data + off%BSIZE, m, 1) == -1) {
       brelse(bp);
       tot = -1;
       break;
@@ -494,6 +1067,37 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Start reading n blocks of ip, starting at block bn,
+// into the buffer cache, without waiting for them.
+// Stops at the end of the file.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint bn, uint n)
+{
+  uint addr[MAXSEG], end;
+  int m;
+
+  if(ip->fat)
+    return;
+  end = (ip->size + BSIZE - 1) / BSIZE;
+  if(bn >= end)
+    return;
+  if(n < end - bn)
+    end = bn + n;
+  m = 0;
+  for(; bn < end; bn++){
+    if(ip->type == T_FILE && pcache_lookup(ip, bn / (PGSIZE/BSIZE)))
+      continue;
+    if((addr[m] = bmap(ip, bn)) == 0)
+      break;
+    if(++m == MAXSEG){
+      breadahead(ip->dev, addr, m);
+      m = 0;
+    }
+  }
+  breadahead(ip->dev, addr, m);
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -505,38 +1109,148 @@ int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  struct buf *bp, *run[MAXSEG];
+  int nrun;
+  struct upage u = { 1, 0 };
+  char *pg;
 
+  if(ip->fat)
+    return fatwrite(ip, user_src, src, off, n);
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  nrun = 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+    if(off/BSIZE >= (ip->size + BSIZE - 1)/BSIZE){
+      // a block past the old end of the file, which bmap()
+      // just allocated: nothing to read, but must be cleared.
+      bp = bnew(ip->dev, addr);
+      memset(bp->data, 0, BSIZE);
+    } else {
+      bp = bread(ip->dev, addr);
+    }
+    if(ucopy(&u, user_src, src, (char*)bp->data + off%BSIZE, m, 0) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    if(ip->type == T_FILE && (pg = pcache_lookup(ip, off/PGSIZE)) != 0)
+      memmove(pg + off%PGSIZE, bp->data + off%BSIZE, m);
+    if(ip->type == T_FILE && log_inplace(bp)){
+      // ordered data: write file contents in place, and
+      // wait for them before the op's metadata can commit.
+      run[nrun++] = bp;
+      if(nrun == MAXSEG){
+        bflush(run, nrun);
+        nrun = 0;
+      }
+    } else {
+      log_write(bp);
+      brelse(bp);
+    }
   }
+  bflush(run, nrun);
 
   if(off > ip->size)
     ip->size = off;
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->ext[].
   iupdate(ip);
 
   return tot;
 }
 
+// Read (or, if write, write) the n bytes of ip at off to (from)
+// user address ua, moving the data straight between the disk and
+// the user's pages instead of through the buffer cache. off and n
+// must be multiples of BSIZE; a read that ends in a partial last
+// block reads that block through the cache. Blocks that are in
+// the cache anyway are copied through it, so it stays coherent;
+// holding ip->lock keeps others from bringing the file's blocks
+// into the cache meanwhile. Writes must be inside a transaction.
+// Caller must hold ip->lock.
+// Returns the number of bytes moved, like readi() and writei().
+int
+directi(struct inode *ip, int write, uint64 ua, uint off, uint n)
+{
+  uint tot, bn, addr, nb, a;
+  struct buf *bp;
+  struct upage u = { 1, 0 };
+  char *pg;
+  pagetable_t pt = myproc()->pagetable;
+
+  if(off % BSIZE || n % BSIZE)
+    panic("directi");
+  if(off > ip->size || off + n < off)
+    return write ? -1 : 0;
+  if(write){
+    if(off + n > MAXFILE*BSIZE)
+      return -1;
+    if(!log_ordered())
+      return writei(ip, 1, ua, off, n);
+  } else if(off + n > ip->size){
+    n = ip->size - off;
+  }
+
+  for(tot = 0; tot + BSIZE <= n; tot += nb*BSIZE){
+    bn = (off + tot) / BSIZE;
+    if((addr = bmap(ip, bn)) == 0)
+      break;
+    nb = 1;
+    if(bcached(ip->dev, addr)){
+      bp = bread(ip->dev, addr);
+      if(ucopy(&u, 1, ua + tot, (char*)bp->data, BSIZE, !write) < 0){
+        brelse(bp);
+        break;
+      }
+      if(write){
+        if(log_inplace(bp))
+          bwrite(bp);
+        else
+          log_write(bp);
+        if((pg = pcache_lookup(ip, (off + tot)/PGSIZE)) != 0)
+          memmove(pg + (off + tot)%PGSIZE, bp->data, BSIZE);
+      }
+      brelse(bp);
+      continue;
+    }
+    // gather the following blocks while they are consecutive
+    // on disk and not cached, and move them in one go.
+    while(tot + (nb+1)*BSIZE <= n){
+      if((a = bmap(ip, bn + nb)) != addr + nb || bcached(ip->dev, a))
+        break;
+      nb++;
+    }
+    if(virtio_disk_user(ip->dev, pt, (uint64)addr * (BSIZE/512),
+                        ua + tot, (uint64)nb * BSIZE, write) < 0)
+      break;
+    // keep cached pages the same as what is now on disk.
+    for(a = off + tot; write && a < off + tot + nb*BSIZE; a += BSIZE)
+      if((pg = pcache_lookup(ip, a/PGSIZE)) != 0)
+        ucopy(&u, 1, ua + (a - off), pg + a%PGSIZE, BSIZE, 0);
+  }
+
+  if(write){
+    if(off + tot > ip->size)
+      ip->size = off + tot;
+    iupdate(ip);
+  } else if(tot < n && n - tot < BSIZE){
+    // the partial last block.
+    int r = readi(ip, 1, ua + tot, off + tot, n - tot);
+    if(r < 0)
+      return tot ? tot : -1;
+    tot += r;
+  }
+  return tot;
+}
+
 // Directories
 
 int
@@ -545,34 +1259,292 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Block number of directory dp's index, 0 if it is linear.
+static uint
+dindex(struct inode *dp)
+{
+  return (uint)(ushort)dp->major << 16 | (ushort)dp->minor;
+}
+
+// FNV-1a; mkfs has a copy.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Return a locked buf holding block bn of directory dp, or 0 if
+// out of disk space. If fresh, bn is past the end of dp, so clear
+// it rather than read it.
+static struct buf*
+dirblock(struct inode *dp, uint bn, int fresh)
+{
+  struct buf *bp;
+  uint addr;
+
+  if((addr = bmap(dp, bn)) == 0)
+    return 0;
+  if(!fresh)
+    return bread(dp->dev, addr);
+  bp = bnew(dp->dev, addr);
+  memset(bp->data, 0, BSIZE);
+  return bp;
+}
+
+// The block of indexed directory dp that holds name, if anywhere.
+static uint
+dirbucket(struct inode *dp, char *name)
+{
+  struct buf *bp;
+  struct dirindex *x;
+  uint bn;
+
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    return 0;
+  bp = bread(dp->dev, dindex(dp));
+  x = (struct dirindex*)bp->data;
+  bn = x->bucket[dirhash(name) & ((1 << x->depth) - 1)];
+  brelse(bp);
+  return bn;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Consults the directory entry cache first, and
+// enters what it finds there, or that it found nothing.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, bn;
+  struct dirent de, *d;
+  struct buf *bp;
+  int i;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
+  if(dp->fat)
+    return fatlookup(dp, name);
+
+  if(dcache_lookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
+  inum = off = 0;
+  if(dindex(dp)){
+    // only the name's bucket can have it.
+    bn = dirbucket(dp, name);
+    if((bp = dirblock(dp, bn, 0)) == 0)
+      panic("dirlookup bucket");
+    d = (struct dirent*)bp->data;
+    for(i = 0; i < DPB; i++){
+      if(d[i].inum != 0 && namecmp(name, d[i].name) == 0){
+        inum = d[i].inum;
+        off = bn*BSIZE + i*sizeof(de);
+        break;
+      }
+    }
+    brelse(bp);
+  } else {
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlookup read");
+      if(de.inum == 0)
+        continue;
+      if(namecmp(name, de.name) == 0){
+        // entry matches path element
+        inum = de.inum;
+        break;
+      }
+    }
+  }
+
+  dcache_enter(dp, name, inum, inum ? off : 0);
+  if(inum == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
+}
+
+// Turn dp, a full linear directory of DIRLINEAR blocks, into an
+// indexed one with twice as many buckets. Returns -1, leaving dp
+// linear, if a bucket would overflow or the disk is full.
+static int
+dirconvert(struct inode *dp)
+{
+  struct buf *bp[2*DIRLINEAR], *ib;
+  struct dirent *old, *d;
+  struct dirindex *x;
+  int i, j, b, n, cnt[2*DIRLINEAR];
+  uint ia;
+
+  n = 2*DIRLINEAR;
+  if((old = kalloc()) == 0)
+    return -1;
+  if(readi(dp, 0, (uint64)old, 0, DIRLINEAR*BSIZE) != DIRLINEAR*BSIZE)
+    panic("dirconvert read");
+
+  // will every bucket have room? "." and ".." stay in bucket 0.
+  memset(cnt, 0, sizeof(cnt));
+  cnt[0] = 2;
+  for(i = 2; i < DIRLINEAR*DPB; i++)
+    if(old[i].inum && ++cnt[dirhash(old[i].name) % n] > DPB)
+      goto bad;
+
+  if((ia = balloc(dp->dev, 0)) == 0)
+    goto bad;
+  for(b = 0; b < n; b++){
+    if((bp[b] = dirblock(dp, b, b >= DIRLINEAR)) == 0){
+      while(--b >= 0)
+        brelse(bp[b]);
+      bfree(dp->dev, ia);
+      goto bad;
+    }
+  }
+
+  for(b = 0; b < n; b++)
+    memset(bp[b]->data, 0, BSIZE);
+  memmove(bp[0]->data, old, 2*sizeof(*old));
+  for(i = 2; i < DIRLINEAR*DPB; i++){
+    if(old[i].inum == 0)
       continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+    b = dirhash(old[i].name) % n;
+    d = (struct dirent*)bp[b]->data;
+    for(j = b == 0 ? 2 : 0; d[j].inum != 0; j++)
+      ;
+    d[j] = old[i];
+  }
+  for(b = 0; b < n; b++){
+    log_write(bp[b]);
+    brelse(bp[b]);
+  }
+
+  ib = bnew(dp->dev, ia);
+  memset(ib->data, 0, BSIZE);
+  x = (struct dirindex*)ib->data;
+  for(x->depth = 0; (1 << x->depth) < n; x->depth++)
+    ;
+  for(b = 0; b < n; b++){
+    x->bucket[b] = b;
+    x->ldepth[b] = x->depth;
+  }
+  log_write(ib);
+  brelse(ib);
+
+  dp->size = n*BSIZE;
+  dp->major = ia >> 16;
+  dp->minor = ia & 0xffff;
+  iupdate(dp);
+  kfree(old);
+  dcache_purge(dp->dev, dp->inum);  // offsets changed
+  return 0;
+
+bad:
+  kfree(old);
+  return -1;
+}
+
+// Split the bucket of indexed directory dp that hash value h
+// selects into two, doubling the index if need be.
+// Returns -1 if the directory can't grow.
+static int
+dirsplit(struct inode *dp, uint h)
+{
+  struct buf *ib, *ob, *nb;
+  struct dirindex *x;
+  struct dirent *od, *nd;
+  uint bn, nbn, ld, n;
+  int i, j;
+
+  ib = bread(dp->dev, dindex(dp));
+  x = (struct dirindex*)ib->data;
+  bn = x->bucket[h & ((1 << x->depth) - 1)];
+  ld = x->ldepth[h & ((1 << x->depth) - 1)];
+  nbn = dp->size / BSIZE;
+  if((ld == x->depth && (1 << x->depth) == NDIRINDEX) || nbn >= MAXFILE ||
+     (nb = dirblock(dp, nbn, 1)) == 0){
+    brelse(ib);
+    return -1;
+  }
+  ob = dirblock(dp, bn, 0);
+
+  if(ld == x->depth){
+    n = 1 << x->depth;
+    memmove(x->bucket + n, x->bucket, n * sizeof(x->bucket[0]));
+    memmove(x->ldepth + n, x->ldepth, n);
+    x->depth++;
+  }
+  for(i = 0; i < (1 << x->depth); i++){
+    if(x->bucket[i] == bn){
+      x->ldepth[i] = ld + 1;
+      if((i >> ld) & 1)
+        x->bucket[i] = nbn;
+    }
+  }
+
+  // move the names whose bit ld is set.
+  od = (struct dirent*)ob->data;
+  nd = (struct dirent*)nb->data;
+  j = 0;
+  for(i = bn == 0 ? 2 : 0; i < DPB; i++){
+    if(od[i].inum && ((dirhash(od[i].name) >> ld) & 1)){
+      nd[j++] = od[i];
+      memset(&od[i], 0, sizeof(od[i]));
     }
   }
 
+  log_write(ob);
+  log_write(nb);
+  log_write(ib);
+  brelse(ob);
+  brelse(nb);
+  brelse(ib);
+  dp->size += BSIZE;
+  iupdate(dp);
+  dcache_purge(dp->dev, dp->inum);  // offsets changed
   return 0;
 }
 
+// Find a free dirent slot for name in indexed directory dp,
+// splitting its bucket while it is full; the names in it may
+// all land on the same side of a split. Returns the slot's
+// offset, or -1 once the index or the file can't grow.
+static int
+dirslot(struct inode *dp, char *name)
+{
+  struct buf *bp;
+  struct dirent *d;
+  uint bn;
+  int i, split;
+
+  for(split = 0; ; split = 1){
+    if(split && dirsplit(dp, dirhash(name)) < 0)
+      break;
+    bn = dirbucket(dp, name);
+    if((bp = dirblock(dp, bn, 0)) == 0)
+      break;
+    d = (struct dirent*)bp->data;
+    for(i = bn == 0 ? 2 : 0; i < DPB; i++){
+      if(d[i].inum == 0){
+        brelse(bp);
+        return bn*BSIZE + i*sizeof(*d);
+      }
+    }
+    brelse(bp);
+  }
+  return -1;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
@@ -582,24 +1554,38 @@ dirlink(struct inode *dp, char *name, uint inum)
   struct dirent de;
   struct inode *ip;
 
+  // no hard links into FAT directories.
+  if(dp->fat)
+    return -1;
+
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
     iput(ip);
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dindex(dp) == 0){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+    // Full and big enough to be worth indexing?
+    if(off == DIRLINEAR*BSIZE && dp->size == off && dirconvert(dp) == 0)
+      off = dirslot(dp, name);
+  } else {
+    off = dirslot(dp, name);
   }
+  if(off < 0)
+    return -1;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcache_enter(dp, name, inum, off);
 
   return 0;
 }
@@ -6,8 +6,10 @@
 #define BSIZE 1024  // block size
 
 // Disk layout:
-// [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+// [ boot block | super block | log | group 0 | group 1 | ... ]
+// where each allocation group is
+// [ inode blocks | free bit map block | data blocks ]
+// and holds ginodes inodes, numbered on from the previous group's.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -18,15 +20,33 @@ struct superblock {
   uint ninodes;      // Number of inodes.
   uint nlog;         // Number of log blocks
   uint logstart;     // Block number of first log block
-  uint inodestart;   // Block number of first inode block
-  uint bmapstart;    // Block number of first free map block
+  uint ngroups;      // Number of allocation groups
+  uint gstart;       // Block number of first group
+  uint gsize;        // Blocks per group, at most BPB; the last may be short
+  uint ginodes;      // Inodes per group, a multiple of 64 and of IPB
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// A file's blocks are a sequence of extents, runs of
+// consecutive disk blocks, in file order. The inode holds
+// the first NEXTENT; a file with more has an index block
+// listing leaf blocks of further extents.
+struct extent {
+  uint start;  // first disk block
+  uint len;    // number of blocks; 0 if unused
+};
+
+// An entry of an extent index block.
+struct eindex {
+  uint fbn;    // file block the leaf's first extent starts at
+  uint leaf;   // leaf block; 0 if unused
+};
+
+#define NEXTENT 6
+#define NLEAFEXT (BSIZE / sizeof(struct extent))
+#define NEINDEX (BSIZE / sizeof(struct eindex))
+#define MAXFILE 4096  // in blocks; extents could map more than the disk
 
 // On-disk inode structure
 struct dinode {
@@ -35,20 +55,32 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // First extents
+  uint eindex;          // Extent index block, or 0
 };
 
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
+// First block of group g
+#define GBASE(g, sb)  (sb.gstart + (g) * sb.gsize)
+
+// Group of inode i, and of block b
+#define IGROUP(i, sb) ((i) / sb.ginodes)
+#define BGROUP(b, sb) (((b) - sb.gstart) / sb.gsize)
+
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb)     (GBASE(IGROUP(i, sb), sb) + (i) % sb.ginodes / IPB)
 
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
-// Block of free map containing bit for block b
-#define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
+// Free map block of group g, and the one containing the bit for block b
+#define GBMAP(g, sb)  (GBASE(g, sb) + sb.ginodes / IPB)
+#define BBLOCK(b, sb) GBMAP(BGROUP(b, sb), sb)
+
+// Bit for block b in its free map block
+#define BBIT(b, sb)   (((b) - sb.gstart) % sb.gsize)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -58,3 +90,24 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows DIRLINEAR blocks is indexed: each of
+// its blocks is a bucket holding the names that hash to it, and an
+// index block maps hash values to buckets (extendible hashing: the
+// low depth bits of a name's hash select an index entry). The
+// buckets still hold plain dirents, so readers that scan a
+// directory from start to end see no difference. "." and ".."
+// stay in the first two slots of block 0. The directory's major
+// and minor, unused otherwise, hold the high and low halves of
+// the index block's number; 0 for a linear directory.
+#define DIRLINEAR 2
+#define NDIRINDEX 256  // maximum number of index entries
+
+struct dirindex {
+  ushort depth;               // 1<<depth index entries are in use
+  uchar ldepth[NDIRINDEX];    // local depth of each entry's bucket
+  ushort bucket[NDIRINDEX];   // directory block # of each entry's bucket
+};
+
@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// pipe buffers, and cached file pages. Allocates whole
+// 4096-byte pages, and counts references to them.
 
 #include "types.h"
 #include "param.h"
@@ -11,6 +12,8 @@
 
 void freerange(void *pa_start, void *pa_end);
 
+#define NSHRINK 8  // pages to reclaim from a cache at a time
+
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
@@ -21,8 +24,12 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  uint64 nfree;  // number of pages on freelist
+  int ref[(PHYSTOP - KERNBASE) / PGSIZE];  // references to each page
 } kmem;
 
+#define PGREF(pa) kmem.ref[((uint64)(pa) - KERNBASE) / PGSIZE]
+
 void
 kinit()
 {
@@ -39,10 +46,11 @@ freerange(void *pa_start, void *pa_end)
     kfree(p);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(void *pa)
 {
@@ -51,6 +59,15 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  acquire(&kmem.lock);
+  if(PGREF(pa) > 1){
+    PGREF(pa)--;
+    release(&kmem.lock);
+    return;
+  }
+  PGREF(pa) = 0;
+  release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
@@ -59,24 +76,60 @@ kfree(void *pa)
   acquire(&kmem.lock);
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   release(&kmem.lock);
 }
 
-// Allocate one 4096-byte page of physical memory.
+// Allocate one 4096-byte page of physical memory, with
+// one reference to it.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// If memory is short, first ask the page cache, whose
+// clean pages are cheap to read back in, and then the
+// buffer cache to give some back.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(;;){
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+      PGREF(r) = 1;
+    }
+    release(&kmem.lock);
+    if(r || (pshrink(NSHRINK) == 0 && bshrink(NSHRINK) == 0))
+      break;
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Take another reference to the allocated page at pa, e.g.
+// to map a page-cache page into a process as well.
+void
+kdup(void *pa)
+{
+  acquire(&kmem.lock);
+  if(PGREF(pa) < 1)
+    panic("kdup");
+  PGREF(pa)++;
+  release(&kmem.lock);
+}
+
+// Return the number of free pages.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+
+  acquire(&kmem.lock);
+  n = kmem.nfree;
+  release(&kmem.lock);
+  return n;
+}
@@ -6,33 +6,79 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
 // calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
+// no FS system calls of the transaction active. Thus there is
+// never any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end, or begin_opn(n)/end_op() if it knows
+// it writes at most n blocks. Usually begin_op() just
+// increments the count of in-progress FS system calls,
+// reserves space in the transaction, and returns.
+// But if the running transaction is close to filling up, or
+// has been open for COMMITTICKS, begin_op() closes it: it takes
+// no new system calls, and the last outstanding end_op() commits
+// it. Committing first copies the transaction's blocks into log
+// buffers, and then opens the next transaction, so the system
+// calls waiting in begin_op() run while the commit's disk writes
+// are in progress. Only one commit at a time is writing.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+//   header block, containing the position and sequence
+//     number of the oldest transaction not yet checkpointed
+//   body: the rest of the log, a circular buffer of
+//     committed transactions, each of which is
+//       descriptor block, with the sequence number and
+//         block #s for block A, B, C, ...
+//       block A
+//       block B
+//       block C
+//       ...
+// A transaction is written contiguously; if it does not fit
+// before the end of the body, it starts over at the beginning.
+//
+// Committing writes the descriptor and the transaction's blocks
+// together, in one go; the descriptor holds a checksum of its
+// block list and the blocks, and a transaction is committed once
+// the checksum matches what is on disk. Installing the blocks
+// at their home locations ("checkpointing") is left to a kernel
+// thread, which does it for many transactions at once, writing
+// only the newest copy of each block, and then moves the tail in
+// the header forward. Until then, the home blocks stay pinned in
+// the buffer cache, and so do the log blocks, whose contents are
+// what gets installed.
+//
+// File data is not logged ("ordered data"): writei() writes it
+// in place, and waits for it, before its op ends, so it is on
+// disk before the metadata that points to it commits. Data
+// blocks fall back to the log when an uncheckpointed
+// transaction has logged them, since the checkpointer would
+// overwrite them with the old copy. And a block that a not yet
+// committed transaction freed isn't reused, since a crash would
+// give it back to the file that had it.
+
+#define LOGMAGIC 0x10674c6f
+#define NFREED 1024
+
+// Contents of the header block.
 struct logheader {
+  uint tail;  // body position of the oldest live transaction
+  uint seq;   // and its sequence number
+};
+
+// Contents of a transaction's descriptor block. Also used
+// to keep track in memory of logged block# before commit.
+struct logdesc {
+  uint magic;
+  uint seq;
+  uint sum;   // descsum(): of seq, n, block[] and the logged blocks
   int n;
   int block[LOGSIZE];
 };
@@ -40,107 +86,265 @@ struct logheader {
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // number of blocks in the body
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they reserved in begin_opn()
+  int closing;     // running transaction takes no new sys calls.
+  int committing;  // a commit is writing to the log.
+  uint opened;     // ticks when the running transaction began
   int dev;
-  struct logheader lh;
+  struct logdesc lh;  // the running transaction
+  struct logdesc ct;  // the transaction being committed
+  struct buf *cfrom[LOGSIZE];  // its cached home blocks
+  struct buf *cbuf[1+LOGSIZE]; // its descriptor and log blocks
+
+  // The body, as positions 0..size-1.
+  // Commits take space at head; the checkpointer frees it at tail.
+  // used counts blocks from tail to head, including any skipped at
+  // the end when a transaction wrapped; cused counts the same, but
+  // only up to the end of the last transaction that has committed,
+  // chead, so it leaves out a commit in progress.
+  int head;
+  uint seq;        // sequence number of the next transaction
+  int used;
+  int tail;
+  int chead;
+  uint cseq;       // sequence number of the transaction at chead
+  int cused;
+  int waiting;     // commits waiting for space
+
+  // For each body position holding a committed block: the cached
+  // home block and the cached log block, both pinned.
+  struct buf *hbuf[NLOG];
+  struct buf *lbuf[NLOG];
+
+  // Blocks freed by transactions that have not committed.
+  // Transactions are numbered from 1 by tid; the running one
+  // is tid, and all through donetid have committed.
+  uint tid;
+  uint ctid;       // the transaction being committed
+  uint donetid;
+  uint overflow;   // a transaction that freed more than fit
+  int nfreed;
+  struct {
+    uint blockno;
+    uint tid;
+  } freed[NFREED];
 };
 struct log log;
 
+// Bufs through which checkpoint() writes log block contents
+// to home locations; not part of the buffer cache.
+#define NSHADOW 64
+static struct buf shadow[NSHADOW];
+
+// And the one through which write_head() writes the header,
+// so that the checkpointer never needs a buffer from bget(),
+// which may be waiting for it to unpin some.
+static struct buf headbuf;
+static uchar headdata[BSIZE] __attribute__((aligned(BSIZE)));
+
 static void recover_from_log(void);
 static void commit();
+static void checkpointer(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logdesc) >= BSIZE)
+    panic("initlog: too big logdesc");
+  // a transaction that wraps also takes the blocks it skips at
+  // the end of the body, up to another 1+LOGSIZE; with less room
+  // than twice that, it might not fit even in an empty log.
+  if (sb->nlog > NLOG || sb->nlog - 1 < 2*(1 + LOGSIZE))
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
   log.dev = dev;
+  log.tid = 1;
+  for(int i = 0; i < NSHADOW; i++)
+    initsleeplock(&shadow[i].lock, "shadow");
+  initsleeplock(&headbuf.lock, "loghead");
   recover_from_log();
+  if(kthread(checkpointer, "checkpoint") < 0)
+    panic("initlog: kthread");
+}
+
+// Disk block of body position pos.
+static uint
+logblock(int pos)
+{
+  return log.start + 1 + pos;
 }
 
-// Copy committed blocks from log to their home location
+// Write the log header, with tail as the oldest live
+// transaction, whose sequence number is seq. Goes around
+// the buffer cache; only recover_from_log() reads the header,
+// at boot, before any write.
 static void
-install_trans(int recovering)
+write_head(int tail, uint seq)
 {
-  int tail;
+  struct buf *buf = &headbuf;
+  struct logheader *hb = (struct logheader *) headdata;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  acquiresleep(&buf->lock);
+  buf->dev = log.dev;
+  buf->blockno = log.start;
+  buf->data = headdata;
+  memset(headdata, 0, BSIZE);
+  hb->tail = tail;
+  hb->seq = seq;
+  bwrite(buf);
+  releasesleep(&buf->lock);
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// Fold the word w into the checksum sum.
+static uint
+logword(uint sum, uint w)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
-  brelse(buf);
+  return ((sum << 5) | (sum >> 27)) + w;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Fold the BSIZE bytes at data into the checksum sum.
+static uint
+logsum(uint sum, uchar *data)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
-  bwrite(buf);
-  brelse(buf);
+  uint *w = (uint *) data;
+
+  for(int i = 0; i < BSIZE / sizeof(uint); i++)
+    sum = logword(sum, w[i]);
+  return sum;
+}
+
+// The checksum of descriptor d itself, which the logged blocks'
+// contents are then folded into. Covering the block list means a
+// torn descriptor can't send good data to the wrong home blocks.
+static uint
+descsum(struct logdesc *d)
+{
+  uint sum;
+
+  sum = logword(d->seq, d->n);
+  for(int i = 0; i < d->n; i++)
+    sum = logword(sum, d->block[i]);
+  return sum;
 }
 
+// Is d the descriptor of transaction seq at body position pos?
+static int
+valid_desc(struct logdesc *d, uint seq, int pos)
+{
+  return d->magic == LOGMAGIC && d->seq == seq &&
+    d->n > 0 && d->n <= LOGSIZE && pos + 1 + d->n <= log.size;
+}
+
+// Install every committed transaction, starting at the
+// tail, in order; later copies of a block overwrite
+// earlier ones.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf, *lbuf, *dbuf;
+  struct logdesc *d;
+  int i, pos, n;
+  uint seq, sum;
+
+  buf = bread(log.dev, log.start);
+  pos = ((struct logheader *) (buf->data))->tail;
+  seq = ((struct logheader *) (buf->data))->seq;
+  brelse(buf);
+
+  for(;;){
+    if(pos >= log.size)
+      pos = 0;
+    buf = bread(log.dev, logblock(pos));
+    d = (struct logdesc *) (buf->data);
+    if(!valid_desc(d, seq, pos)){
+      brelse(buf);
+      // perhaps this transaction didn't fit and wrapped.
+      if(pos == 0)
+        break;
+      pos = 0;
+      continue;
+    }
+    n = d->n;
+
+    // a torn commit leaves a descriptor whose blocks
+    // don't match its checksum.
+    sum = descsum(d);
+    for (i = 0; i < n; i++) {
+      lbuf = bread(log.dev, logblock(pos+1+i));
+      sum = logsum(sum, lbuf->data);
+      brelse(lbuf);
+    }
+    if(sum != d->sum){
+      brelse(buf);
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      lbuf = bread(log.dev, logblock(pos+1+i)); // read log block
+      dbuf = bnew(log.dev, d->block[i]);
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    brelse(buf);
+    pos += 1 + n;
+    seq++;
+  }
+
+  // everything is home; start over with an empty log.
+  log.head = log.tail = log.chead = 0;
+  log.used = log.cused = 0;
+  log.seq = log.cseq = seq;
+  write_head(0, seq);
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call
+// that writes at most n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  struct proc *p = myproc();
+
+  if(n > LOGSIZE)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.outstanding > 0 &&
+              (log.lh.n + log.reserved + n > LOGSIZE ||
+               ticks - log.opened >= COMMITTICKS)){
+      // this op might exhaust the transaction's space, or the
+      // transaction has been open long enough; close it and
+      // wait for the next one.
+      log.closing = 1;
       sleep(&log, &log.lock);
     } else {
+      if(log.outstanding == 0 && log.lh.n == 0)
+        log.opened = ticks;
       log.outstanding += 1;
+      log.reserved += n;
+      p->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
 // commits if this was the last outstanding operation.
 void
@@ -150,11 +354,13 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
+  log.reserved -= myproc()->logres;
+  myproc()->logres = 0;
   if(log.outstanding == 0){
+    // keep new ops out until commit() has copied
+    // this transaction's blocks.
     do_commit = 1;
-    log.committing = 1;
+    log.closing = 1;
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -167,38 +373,247 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
+  }
+}
+
+// Take n contiguous body blocks for the next transaction, waiting
+// for the checkpointer to free space if need be. Sets *seq to the
+// transaction's sequence number and returns its body position.
+// Caller must hold log.lock.
+static int
+log_alloc(int n, uint *seq)
+{
+  int pos, need;
+
+  while(1){
+    pos = log.head;
+    need = n;
+    if(pos + n > log.size){
+      // skip what is left at the end.
+      need += log.size - pos;
+      pos = 0;
+    }
+    if(log.used + need <= log.size)
+      break;
+    log.waiting++;
+    wakeup(&log.cused);
+    sleep(&log.used, &log.lock);
+    log.waiting--;
+  }
+  log.used += need;
+  log.head = pos + n;
+  *seq = log.seq++;
+  return pos;
+}
+
+// Write log.ct, whose blocks the log buffers log.cbuf[1..n] hold
+// copies of, taken from the cached home blocks log.cfrom[], at body
+// position pos (old was the head before it, which differs if it
+// wrapped). The descriptor and the blocks are consecutive on disk,
+// and go out together; once they are all written, the transaction
+// has committed. Afterwards the blocks belong to the checkpointer.
+static void
+write_log(int pos, int old)
+{
+  int i, j, n;
+  struct logdesc *t = &log.ct, *d;
+  struct buf **to = log.cbuf + 1;
+
+  n = t->n;
+  log.cbuf[0] = bnew(log.dev, logblock(pos));
+  d = (struct logdesc *) (log.cbuf[0]->data);
+  memset(d, 0, BSIZE);
+  d->magic = LOGMAGIC;
+  d->seq = t->seq;
+  d->n = n;
+  for (i = 0; i < n; i++)
+    d->block[i] = t->block[i];
+  d->sum = descsum(d);
+  for (i = 0; i < n; i++)
+    d->sum = logsum(d->sum, to[i]->data);
+  bwritev(log.cbuf, 1 + n);  // write the log
+  for (i = 0; i < 1 + n; i++)
+    bwait_poll(log.cbuf[i]);
+  brelse(log.cbuf[0]);
+
+  // Hand the transaction to the checkpointer. The home
+  // blocks are still pinned from log_write(); pin the
+  // log blocks too, since the checkpointer installs from them.
+  acquire(&log.lock);
+  if(pos != old)  // wrapped
+    for(i = old; i < log.size; i++)
+      log.hbuf[i] = log.lbuf[i] = 0;
+  log.hbuf[pos] = log.lbuf[pos] = 0;
+  for (i = 0; i < n; i++) {
+    bpin(to[i]);
+    log.hbuf[pos+1+i] = log.cfrom[i];
+    log.lbuf[pos+1+i] = to[i];
+  }
+  log.cused += (pos != old ? log.size - old : 0) + 1 + n;
+  log.chead = pos + 1 + n;
+  log.cseq = t->seq + 1;
+  log.donetid = log.ctid;
+  for(i = 0, j = 0; i < log.nfreed; i++)
+    if(log.freed[i].tid > log.donetid)
+      log.freed[j++] = log.freed[i];
+  log.nfreed = j;
+  if(log.cused >= log.size / 2 || bshort())
+    wakeup(&log.cused);
+  release(&log.lock);
+
+  for (i = 0; i < n; i++)
+    brelse(to[i]);
+}
+
+// Commit the running transaction, which has no outstanding
+// ops and has been closed to new ones.
+static void
+commit()
+{
+  int i, n, pos, old;
+  struct buf **from = log.cfrom, **to = log.cbuf + 1;
+
+  acquire(&log.lock);
+  while(log.committing)
+    sleep(&log.committing, &log.lock);
+  if(log.lh.n == 0){
+    log.closing = 0;
     wakeup(&log);
     release(&log.lock);
+    return;
+  }
+  log.committing = 1;
+  log.ct = log.lh;
+  log.lh.n = 0;
+  log.ctid = log.tid++;
+  n = log.ct.n;
+  old = log.head;
+  pos = log_alloc(1 + n, &log.ct.seq);
+  release(&log.lock);
+
+  // Copy the blocks into log buffers while no op can change them.
+  for (i = 0; i < n; i++) {
+    from[i] = bread(log.dev, log.ct.block[i]); // cache block
+    to[i] = bnew(log.dev, logblock(pos+1+i)); // log block
+    memmove(to[i]->data, from[i]->data, BSIZE);
+    brelse(from[i]);  // still pinned
   }
+
+  // Let the next transaction start while this one is written.
+  acquire(&log.lock);
+  log.closing = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  write_log(pos, old);
+
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log.committing);
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Install all committed transactions at their home locations
+// and free their log space.
 static void
-write_log(void)
+checkpoint(void)
 {
-  int tail;
+  static int pos[NLOG];
+  struct buf *b, *sp[NSHADOW];
+  int i, j, k, m, n, nw, lo, hi, p, tail, end;
+  uint seq, blockno;
+
+  acquire(&log.lock);
+  tail = log.tail;
+  n = log.cused;
+  end = log.chead;
+  seq = log.cseq;
+  release(&log.lock);
+  if(n == 0)
+    return;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  // Find the body position of the newest copy of each logged
+  // block, looking from the newest transaction back. Keep them
+  // sorted by block number, so that bwritev() can find runs of
+  // consecutive blocks.
+  nw = 0;
+  for(k = n - 1; k >= 0; k--){
+    p = (tail + k) % log.size;
+    if(log.hbuf[p] == 0)
+      continue;
+    blockno = log.hbuf[p]->blockno;
+    lo = 0;
+    hi = nw;
+    while(lo < hi){
+      m = (lo + hi) / 2;
+      if(log.hbuf[pos[m]]->blockno < blockno)
+        lo = m + 1;
+      else
+        hi = m;
+    }
+    if(lo < nw && log.hbuf[pos[lo]]->blockno == blockno)
+      continue;  // already have a newer copy
+    memmove(&pos[lo+1], &pos[lo], (nw - lo) * sizeof(pos[0]));
+    pos[lo] = p;
+    nw++;
   }
+
+  // Write them, NSHADOW at a time. The shadow bufs are not in
+  // the cache; they just point the disk at the log block contents.
+  for(i = 0; i < nw; i += NSHADOW){
+    m = nw - i < NSHADOW ? nw - i : NSHADOW;
+    for(j = 0; j < m; j++){
+      p = pos[i+j];
+      b = &shadow[j];
+      b->dev = log.dev;
+      b->blockno = log.hbuf[p]->blockno;
+      b->data = log.lbuf[p]->data;
+      acquiresleep(&b->lock);
+      sp[j] = b;
+    }
+    bwritev(sp, m);
+    for(j = 0; j < m; j++){
+      bwait(sp[j]);
+      releasesleep(&sp[j]->lock);
+    }
+  }
+  // The blocks are home; the transactions can go.
+  write_head(end, seq);
+
+  acquire(&log.lock);
+  for(k = 0; k < n; k++){
+    p = (tail + k) % log.size;
+    if(log.hbuf[p] == 0)
+      continue;
+    log.hbuf[p]->logged--;
+    bunpin(log.hbuf[p]);
+    bunpin(log.lbuf[p]);
+    log.hbuf[p] = log.lbuf[p] = 0;
+  }
+  log.tail = end;
+  log.used -= n;
+  log.cused -= n;
+  wakeup(&log.used);
+  release(&log.lock);
 }
 
+// The checkpointer thread. It lets the log fill to half
+// before installing, so that blocks updated by many
+// transactions, like bitmap and inode blocks, are written
+// home once rather than once per transaction; sooner if
+// someone is waiting for log space, or the pinned blocks
+// leave the buffer cache short of buffers.
 static void
-commit()
+checkpointer(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&log.lock);
+  while(1){
+    while(log.cused == 0 ||
+          (log.cused < log.size / 2 && log.waiting == 0 && !bshort()))
+      sleep(&log.cused, &log.lock);
+    release(&log.lock);
+    checkpoint();
+    acquire(&log.lock);
   }
 }
 
@@ -217,7 +632,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= LOGSIZE)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -229,8 +644,93 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    b->logged++;
     log.lh.n++;
+    if(log.cused > 0 && bshort())
+      wakeup(&log.cused);
+  }
+  release(&log.lock);
+}
+
+// Called by bget() when every buffer is in use, most likely
+// because the log has them pinned: wake the checkpointer and
+// wait for it to install the committed transactions, which
+// unpins their blocks. Returns -1 if none have committed.
+int
+log_unpin(void)
+{
+  acquire(&log.lock);
+  if(log.cused == 0){
+    release(&log.lock);
+    return -1;
   }
+  log.waiting++;
+  wakeup(&log.cused);
+  sleep(&log.used, &log.lock);
+  log.waiting--;
   release(&log.lock);
+  return 0;
 }
 
+// May writei() write file data block b, which it holds locked,
+// in place rather than through the log?
+int
+log_inplace(struct buf *b)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = b->logged == 0 && log.overflow <= log.donetid;
+  release(&log.lock);
+  return r;
+}
+
+// May a block that isn't in the buffer cache, and so isn't in
+// the log, be written in place? Only if every block freed by an
+// uncommitted transaction is known, so that balloc() didn't hand
+// one of them out.
+int
+log_ordered(void)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = log.overflow <= log.donetid;
+  release(&log.lock);
+  return r;
+}
+
+// Called by bfree() inside an op: the running transaction
+// frees block b.
+void
+log_free(uint b)
+{
+  acquire(&log.lock);
+  if(log.nfreed < NFREED){
+    log.freed[log.nfreed].blockno = b;
+    log.freed[log.nfreed].tid = log.tid;
+    log.nfreed++;
+  } else {
+    // lost track; log all data until this transaction commits.
+    log.overflow = log.tid;
+  }
+  release(&log.lock);
+}
+
+// Was block b freed by a transaction that has not committed?
+int
+log_freed(uint b)
+{
+  int i, r;
+
+  acquire(&log.lock);
+  r = 0;
+  for(i = 0; i < log.nfreed; i++){
+    if(log.freed[i].blockno == b){
+      r = 1;
+      break;
+    }
+  }
+  release(&log.lock);
+  return r;
+}
@@ -7,7 +7,8 @@
 // 02000000 -- CLINT
 // 0C000000 -- PLIC
 // 10000000 -- uart0 
-// 10001000 -- virtio disk 
+// 10001000 -- virtio disk (fs.img)
+// 10002000 -- virtio disk (sdcard.img)
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
 // unused RAM after 80000000.
@@ -24,6 +25,8 @@
 // virtio mmio interface
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define VIRTIO1 0x10002000
+#define VIRTIO1_IRQ 2
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
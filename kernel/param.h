@@ -1,15 +1,28 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // mmap() regions per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum size of in-memory i-node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define SDDEV         2  // device number of the FAT sdcard disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      250  // max data blocks in one transaction
+#define NLOG         1024  // max size of on-disk log in blocks
+#define COMMITTICKS  3  // max age of a transaction before it's closed
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define NBUFMIN      (NBUF+2*NLOG+LOGSIZE)  // ... plus what the log can pin
+#define BCACHEFRAC    8  // disk block cache gets 1/BCACHEFRAC of free memory
+#define ICACHEFRAC   64  // i-node cache gets 1/ICACHEFRAC of free memory
+#define PCACHEFRAC    2  // page cache holds at most 1/PCACHEFRAC of memory
+#define NDENTRY     512  // size of directory entry cache
+#define NFATFILE     64  // FAT files and directories in use
+#define RAMIN        4  // initial read-ahead window, in blocks
+#define RAMAX       32  // maximum read-ahead window, in blocks
+#define MAXSEG      16  // max blocks in one disk request
+#define FSSIZE       10000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
 
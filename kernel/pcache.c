@@ -0,0 +1,183 @@
+// Page cache.
+//
+// Holds the contents of regular files in 4096-byte pages,
+// indexed by file page number (offset / PGSIZE) in a radix
+// tree that hangs off the inode. Each tree node is a page of
+// PGSIZE/8 pointers; a tree of depth d covers 512^d pages,
+// and grows a new root when a file outgrows it.
+//
+// The page cache sits above the buffer cache: readi() fills
+// a page from the file's blocks once, and afterwards reads
+// it without bmap() or bio.c. Writes still go through the
+// buffer cache and the log, and writei() copies what it
+// wrote into the page if there is one, so the page cache
+// never holds anything the disk doesn't.
+//
+// Pages are kalloc() pages with reference counts, so a page
+// can also be mapped into user address spaces; dropping it
+// from the cache then leaves it to the mappings.
+//
+// The cache counts its pages, tree nodes included, and holds
+// at most 1/PCACHEFRAC of memory, so that the files open at a
+// time, whose pages kalloc()'s pshrink() can't take, don't
+// starve the buffer cache and everything else; pget() checks
+// pcachefull() before it adds a page.
+//
+// The caller must hold the inode's lock, or, if nobody
+// references the inode, itable.lock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "memlayout.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPTR      (PGSIZE / sizeof(void*))  // pointers per tree node
+#define PTRSHIFT  9                         // log2(NPTR)
+
+struct {
+  struct spinlock lock;
+  int n;     // pages in all inodes' trees
+  int max;
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.max = (PHYSTOP - KERNBASE) / PGSIZE / PCACHEFRAC;
+}
+
+static void
+pcount(int n)
+{
+  acquire(&pcache.lock);
+  pcache.n += n;
+  release(&pcache.lock);
+}
+
+// Is the page cache at its limit?
+int
+pcachefull(void)
+{
+  int full;
+
+  acquire(&pcache.lock);
+  full = pcache.n >= pcache.max;
+  release(&pcache.lock);
+  return full;
+}
+
+// Does a tree of depth levels reach page pn?
+static int
+reaches(int depth, uint pn)
+{
+  return depth * PTRSHIFT >= 32 || (pn >> (depth * PTRSHIFT)) == 0;
+}
+
+// The page holding page pn of ip's data, or 0 if not cached.
+char*
+pcache_lookup(struct inode *ip, uint pn)
+{
+  void **node = ip->pages;
+  int d;
+
+  if(node == 0 || !reaches(ip->pdepth, pn))
+    return 0;
+  for(d = ip->pdepth - 1; d > 0; d--){
+    node = node[(pn >> (d * PTRSHIFT)) % NPTR];
+    if(node == 0)
+      return 0;
+  }
+  return node[pn % NPTR];
+}
+
+static void**
+newnode(void)
+{
+  void **node;
+
+  if((node = kalloc()) != 0){
+    memset(node, 0, PGSIZE);
+    pcount(1);
+  }
+  return node;
+}
+
+// Enter pg as page pn of ip's data. The cache takes over the
+// caller's reference to pg. Returns -1 if out of memory.
+int
+pcache_insert(struct inode *ip, uint pn, char *pg)
+{
+  void **node, **root;
+  int d;
+
+  if(ip->pages == 0){
+    if((ip->pages = newnode()) == 0)
+      return -1;
+    ip->pdepth = 1;
+  }
+  while(!reaches(ip->pdepth, pn)){
+    if((root = newnode()) == 0)
+      return -1;
+    root[0] = ip->pages;
+    ip->pages = root;
+    ip->pdepth++;
+  }
+
+  node = ip->pages;
+  for(d = ip->pdepth - 1; d > 0; d--){
+    void **slot = &node[(pn >> (d * PTRSHIFT)) % NPTR];
+    if(*slot == 0 && (*slot = newnode()) == 0)
+      return -1;
+    node = *slot;
+  }
+  if(node[pn % NPTR])
+    panic("pcache_insert");
+  node[pn % NPTR] = pg;
+  pcount(1);
+  return 0;
+}
+
+// Free node, a tree of depth levels, and the pages in it.
+// Returns the number of pages (nodes included) let go of.
+static int
+pfree(void **node, int depth)
+{
+  int i, n;
+
+  n = 0;
+  for(i = 0; i < NPTR; i++){
+    if(node[i] == 0)
+      continue;
+    if(depth > 1)
+      n += pfree(node[i], depth - 1);
+    else {
+      kfree(node[i]);
+      n++;
+    }
+  }
+  kfree(node);
+  return n + 1;
+}
+
+// Drop all of ip's cached pages, e.g. because the file was
+// truncated or the inode is being recycled. Returns the
+// number of pages let go of.
+int
+pcache_drop(struct inode *ip)
+{
+  int n;
+
+  if(ip->pages == 0)
+    return 0;
+  n = pfree(ip->pages, ip->pdepth);
+  pcount(-n);
+  ip->pages = 0;
+  ip->pdepth = 0;
+  return n;
+}
@@ -16,6 +16,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -165,6 +166,8 @@ freeproc(struct proc *p)
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
+  p->kfn = 0;
+  memset(p->vma, 0, sizeof(p->vma));
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
@@ -254,6 +257,29 @@ userinit(void)
   release(&p->lock);
 }
 
+// Create a kernel thread that runs fn(), which must never return.
+// It is a process, so it can sleep, but it has no user memory
+// and never goes to user space.
+// Returns its pid, or -1 if there is no free process slot.
+int
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  p->state = RUNNABLE;
+
+  release(&p->lock);
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -264,6 +290,8 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
+    if(sz + n > vmabase(p))
+      return -1;
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
@@ -296,6 +324,13 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // share or copy mmap() regions.
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -351,6 +386,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Unmap mmap() regions, writing back shared ones.
+  vmaclear(p, p->pagetable);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -394,6 +432,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout() below happens with locks held.
+  if(addr != 0)
+    vmatouch(addr, sizeof(pp->xstate), 1);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -518,6 +560,20 @@ yield(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -533,6 +589,7 @@ forkret(void)
     // regular process (e.g., because it calls sleep), and thus cannot
     // be run from main().
     fsinit(ROOTDEV);
+    fatinit();
 
     first = 0;
     // ensure other cores see first=0.
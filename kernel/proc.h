@@ -82,6 +82,16 @@ struct trapframe {
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
+// A region of memory mapped by mmap(); see vma.c.
+struct vma {
+  uint64 addr;       // page-aligned start
+  uint64 len;        // multiple of PGSIZE; 0 if the slot is unused
+  int prot;          // PROT_ bits
+  int flags;         // MAP_ bits
+  struct file *f;    // mapped file; 0 if anonymous
+  uint64 off;        // offset in f of addr
+};
+
 struct proc {
   struct spinlock lock;
 
@@ -102,6 +112,9 @@ struct proc {
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // mmap() regions
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // If non-zero, kernel thread body
+  int logres;                  // Log blocks reserved by begin_opn()
 };
@@ -101,6 +101,8 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_copy_file_range(void);
 extern uint64 sys_openat(void);
 extern uint64 sys_linkat(void);
 extern uint64 sys_mkdirat(void);
@@ -141,11 +143,13 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_sendfile] sys_sendfile,
+[SYS_copy_file_range] sys_copy_file_range,
 [SYS_openat]  sys_openat,
 [SYS_linkat]  sys_linkat,
 [SYS_mkdirat] sys_mkdirat,
-// [SYS_mount]   sys_mount,
-// [SYS_umount2] sys_umount2,
+[SYS_mount]   sys_mount,
+[SYS_umount2] sys_umount2,
 [SYS_execve]  sys_execve,
 [SYS_wait4]   sys_wait4,
 [SYS_mmap]    sys_mmap,
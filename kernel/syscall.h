@@ -29,14 +29,15 @@
 #define SYS_link    19
 #define SYS_mkdir   20
 #define SYS_close   57
+#define SYS_sendfile 71
+#define SYS_copy_file_range 285
 
 // File operations
 #define SYS_openat   56
 #define SYS_linkat   37
 #define SYS_mkdirat  34
-// #define SYS_mount    40
-// #define SYS_umount2  39
-// mount not supported
+#define SYS_mount    40
+#define SYS_umount2  39
 
 // Process management
 #define SYS_execve   221
@@ -124,57 +124,57 @@ pwd(char *buf)
   return ret;
 }
 
+// Mount the FAT volume of the sdcard, the only file system
+// there is to mount, on a directory:
+// mount(special, dir, fstype, flags, data). special, flags
+// and data are ignored.
 uint64
-mount(char *source, char *target, const char *fstype, unsigned long flags)
+sys_mount(void)
 {
-  struct inode *ip1, *ip2;
-  char name[DIRSIZ];
-  uint dev;
-  begin_op();
-  
-  if((ip1 = namei(source)) == 0){
-    end_op();
-    return -1;
-  }
+  char dir[MAXPATH], fstype[16];
+  struct inode *ip;
+  int r;
 
-  ilock(ip1);
-  if(ip1->inum != ROOTINO){
-    iunlock(ip1);
-    end_op();
+  if(argstr(1, dir, MAXPATH) < 0 || argstr(2, fstype, sizeof(fstype)) < 0)
+    return -1;
+  if(strncmp(fstype, "vfat", sizeof(fstype)) != 0 && strncmp(fstype, "fat32", sizeof(fstype)) != 0)
     return -1;
-  }
-
-  dev = ip1->dev;
-  iunlock(ip1);
 
-  ip2 = nameiparent(target, name);
-  if(ip2 == 0){
+  begin_op();
+  if((ip = namei(dir)) == 0){
     end_op();
     return -1;
   }
+  ilock(ip);
+  r = fatmount(ip);
+  iunlockput(ip);
+  end_op();
+  return r;
+}
 
-  ilock(ip2);
-  if(ip2->type != T_DIR){
-    iunlockput(ip2);
-    end_op();
+// umount2(target, flags). flags are ignored.
+uint64
+sys_umount2(void)
+{
+  char dir[MAXPATH];
+  struct inode *ip;
+  int r;
+
+  if(argstr(0, dir, MAXPATH) < 0)
     return -1;
-  }
 
-  if(dirlink(ip2, name, ip1->inum) < 0){
-    iunlockput(ip2);
+  begin_op();
+  if((ip = namei(dir)) == 0){
     end_op();
     return -1;
   }
-
-  iunlockput(ip2);
+  ilock(ip);
+  r = fatumount(ip);
+  iunlockput(ip);
+  if(r == 0)
+    iput(ip);  // the mount's reference
   end_op();
-  return dev;
-}
-
-uint64
-sys_mount(void)
-{
-  panic("TODO");
+  return r;
 }
 
 uint64
@@ -270,7 +270,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(DIRLINKBLOCKS + 1);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -323,7 +323,7 @@ sys_linkat(void) // UNDONE! name[] not populated.
   if(argstr(1, old, MAXPATH) < 0 || argstr(3, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(DIRLINKBLOCKS + 1);
   if((ip = namefd(olddirfd, 0, old)) == 0){
     end_op();
     return -1;
@@ -387,6 +387,7 @@ sys_unlink(void)
   struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
+  int r;
 
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
@@ -403,13 +404,21 @@ sys_unlink(void)
   if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
     goto bad;
 
+  if(dp->fat){
+    r = fatunlink(dp, name);
+    iunlockput(dp);
+    end_op();
+    return r;
+  }
+
   if((ip = dirlookup(dp, name, &off)) == 0)
     goto bad;
   ilock(ip);
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  // a mount point reads as the FAT root, so isn't empty.
+  if(ip->fat || (ip->type == T_DIR && !isdirempty(ip))){
     iunlockput(ip);
     goto bad;
   }
@@ -417,6 +426,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -463,7 +473,15 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if(dp->fat){
+    ip = fatcreate(dp, name, type);
+    iunlockput(dp);
+    if(ip)
+      ilock(ip);
+    return ip;
+  }
+
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -515,7 +533,7 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  begin_opn((omode & O_CREATE) ? CREATEBLOCKS : MAXOPBLOCKS);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -556,6 +574,10 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->ranext = 0;
+    f->rawin = 0;
+    f->raend = 0;
+    f->direct = (omode & O_DIRECT) && ip->type == T_FILE && ip->fat == 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -611,7 +633,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -628,7 +650,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -722,15 +744,23 @@ sys_getdents64(void)
   }
 
   p = myproc();
-  for(off = 0, cur_len = 0; off < dp->size; off += sizeof(de), cur_len += sizeof(ret)) {
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  // a FAT directory has no size; read until readi() runs out.
+  for(off = 0, cur_len = 0; dp->fat || off < dp->size; off += sizeof(de), cur_len += sizeof(ret)) {
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)){
+      if(dp->fat)
+        break;
       panic("sys_getdents64 read");
+    }
     if(de.inum == 0)
       continue;
     ret.d_ino = de.inum;
     safestrcpy(ret.d_name, de.name, DIRSIZ);
-    ip = iget(dp->dev, de.inum);
-    ret.d_type = ip->type;
+    if(dp->fat){
+      ret.d_type = 0;  // unknown
+    } else {
+      ip = iget(dp->dev, de.inum);
+      ret.d_type = ip->type;
+    }
     ret.d_off = sizeof(ret); // todo: should we put special value to indicate it is the last ret?
     ret.d_reclen = sizeof(ret) - sizeof(ret.d_name) + strlen(ret.d_name);
     if (cur_len + sizeof(ret) > len) {
@@ -816,6 +846,95 @@ sys_pipe(void)
   return 0;
 }
 
+// Read the file offset at user address addr, if it isn't 0,
+// into *off.
+static int
+argoff(uint64 addr, uint *off)
+{
+  uint64 x;
+
+  if(addr == 0)
+    return 0;
+  if(copyin(myproc()->pagetable, (char*)&x, addr, sizeof(x)) < 0 || x > 0xffffffff)
+    return -1;
+  *off = x;
+  return 0;
+}
+
+// Store off at user address addr, if it isn't 0.
+static int
+putoff(uint64 addr, uint off)
+{
+  uint64 x = off;
+
+  if(addr == 0)
+    return 0;
+  return copyout(myproc()->pagetable, addr, (char*)&x, sizeof(x));
+}
+
+// sendfile(outfd, infd, offp, n): copy up to n bytes from
+// infd, a regular file, to outfd, a file or a device, in the
+// kernel. Reads at *offp and updates it if offp isn't 0, and
+// otherwise at infd's offset.
+uint64
+sys_sendfile(void)
+{
+  struct file *in, *out;
+  uint64 offp;
+  uint off, dummy;
+  int n, r;
+
+  argaddr(2, &offp);
+  argint(3, &n);
+  if(argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 || n < 0)
+    return -1;
+  if(in->type != FD_INODE)
+    return -1;
+  off = in->off;
+  if(argoff(offp, &off) < 0)
+    return -1;
+  r = filecopy(in, &off, out, out->type == FD_INODE ? &out->off : &dummy, n);
+  if(offp == 0)
+    in->off = off;
+  else if(putoff(offp, off) < 0)
+    return -1;
+  return r;
+}
+
+// copy_file_range(infd, inoffp, outfd, outoffp, n, flags):
+// copy up to n bytes between regular files in the kernel.
+// Each offset pointer that isn't 0 gives the offset to use
+// and is updated; otherwise the file's offset is.
+uint64
+sys_copy_file_range(void)
+{
+  struct file *in, *out;
+  uint64 inoffp, outoffp;
+  uint inoff, outoff;
+  int n, flags, r;
+
+  argaddr(1, &inoffp);
+  argaddr(3, &outoffp);
+  argint(4, &n);
+  argint(5, &flags);
+  if(argfd(0, 0, &in) < 0 || argfd(2, 0, &out) < 0 || n < 0 || flags != 0)
+    return -1;
+  if(in->type != FD_INODE || out->type != FD_INODE)
+    return -1;
+  inoff = in->off;
+  outoff = out->off;
+  if(argoff(inoffp, &inoff) < 0 || argoff(outoffp, &outoff) < 0)
+    return -1;
+  r = filecopy(in, &inoff, out, &outoff, n);
+  if(inoffp == 0)
+    in->off = inoff;
+  if(outoffp == 0)
+    out->off = outoff;
+  if(putoff(inoffp, inoff) < 0 || putoff(outoffp, outoff) < 0)
+    return -1;
+  return r;
+}
+
 uint64
 sys_mkdirat(void)
 {
@@ -825,11 +944,27 @@ sys_mkdirat(void)
 uint64
 sys_mmap(void)
 {
-  return -1;  // Dummy implementation
+  uint64 addr, len, off;
+  int prot, flags;
+  struct file *f;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  f = 0;
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return vmamap(addr, len, prot, flags, f, off);
 }
 
 uint64
 sys_munmap(void)
 {
-  return -1;  // Dummy implementation
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return vmaunmaprange(addr, len);
 }
\ No newline at end of file
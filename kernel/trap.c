@@ -65,6 +65,18 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault: maybe a page of an mmap() region.
+    // read the registers before an interrupt can change them.
+    uint64 cause = r_scause();
+    uint64 va = r_stval();
+
+    intr_on();
+    if(vmafault(p->pagetable, va, cause == 15) < 0){
+      printf("usertrap(): unexpected scause 0x%lx pid=%d\n", cause, p->pid);
+      printf("            sepc=0x%lx stval=0x%lx\n", p->trapframe->epc, va);
+      setkilled(p);
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -195,7 +207,9 @@ devintr()
     if(irq == UART0_IRQ){
       uartintr();
     } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+      virtio_disk_intr(0);
+    } else if(irq == VIRTIO1_IRQ){
+      virtio_disk_intr(1);
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
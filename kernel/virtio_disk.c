@@ -1,8 +1,14 @@
 //
-// driver for qemu's virtio disk device.
+// driver for qemu's virtio disk devices.
 // uses qemu's mmio interface to virtio.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+//          -drive file=sdcard.img,if=none,format=raw,id=x1 -device virtio-blk-device,drive=x1,bus=virtio-mmio-bus.1
+//
+// each device has its own registers, rings and lock, so
+// requests to one don't wait behind requests to the other.
+// disk 0 holds the xv6 file system (ROOTDEV), disk 1 the
+// FAT sdcard (SDDEV).
 //
 
 #include "virtio_disk.h"
@@ -17,10 +23,19 @@
 #include "buf.h"
 #include "virtio.h"
 
-// the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+#define NDISK 2
+
+// the address of virtio mmio register r of disk d.
+#define R(d, r) ((volatile uint32 *)((d)->base + (r)))
+
+// how long virtio_disk_poll() spins before going to sleep,
+// in timer ticks (about 100 microseconds under qemu).
+#define POLLTIME 1000
 
 static struct disk {
+  uint64 base;     // mmio registers
+  int present;     // did virtio_disk_init() find the device?
+
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -42,124 +57,168 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int eventidx;     // was VIRTIO_RING_F_EVENT_IDX negotiated?
+  int inflight;     // number of requests the device has not finished
+  uint64 capacity;  // size of the disk in 512-byte sectors
+  uint blksize;     // the device's preferred block size
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // bufs of a buffer cache request, or
+    int *wait;       // count to decrement when a raw request finishes
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // indirect descriptor tables, one per ring descriptor,
+  // used if the device offers VIRTIO_RING_F_INDIRECT_DESC.
+  int indirect;
+  struct virtq_desc itab[NUM][MAXSEG+2];
   
   struct spinlock vdisk_lock;
   
-} disk;
+} disks[NDISK];
 
-void
-virtio_disk_init(void)
+// the disk that holds the blocks of device dev.
+static struct disk*
+devdisk(uint dev)
+{
+  if(dev == SDDEV)
+    return &disks[1];
+  return &disks[0];
+}
+
+// set up the device at base. returns 0 if there is no
+// virtio disk there.
+static int
+disk_init(struct disk *d, uint64 base)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  d->base = base;
+  initlock(&d->vdisk_lock, "virtio_disk");
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 2 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
+  if(*R(d, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+     *R(d, VIRTIO_MMIO_VERSION) != 2 ||
+     *R(d, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+     *R(d, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+    return 0;
   }
   
   // reset device
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // set ACKNOWLEDGE status bit
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // set DRIVER status bit
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  uint64 features = *R(d, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  d->indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  d->eventidx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // re-read status to ensure FEATURES_OK is set.
-  status = *R(VIRTIO_MMIO_STATUS);
+  status = *R(d, VIRTIO_MMIO_STATUS);
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
   // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+  *R(d, VIRTIO_MMIO_QUEUE_SEL) = 0;
 
   // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
+  if(*R(d, VIRTIO_MMIO_QUEUE_READY))
     panic("virtio disk should not be ready");
 
   // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  uint32 max = *R(d, VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
   if(max < NUM)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
+  d->desc = kalloc();
+  d->avail = kalloc();
+  d->used = kalloc();
+  if(!d->desc || !d->avail || !d->used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
+  memset(d->desc, 0, PGSIZE);
+  memset(d->avail, 0, PGSIZE);
+  memset(d->used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(d, VIRTIO_MMIO_QUEUE_NUM) = NUM;
 
   // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
+  *R(d, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)d->desc;
+  *R(d, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)d->desc >> 32;
+  *R(d, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)d->avail;
+  *R(d, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)d->avail >> 32;
+  *R(d, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)d->used;
+  *R(d, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)d->used >> 32;
 
   // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  *R(d, VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
   // all NUM descriptors start out unused.
   for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+    d->free[i] = 1;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // the disk's size and block size, from its config space.
+  d->capacity = *R(d, VIRTIO_BLK_CFG_CAPACITY) |
+                (uint64)*R(d, VIRTIO_BLK_CFG_CAPACITY + 4) << 32;
+  if(features & (1 << VIRTIO_BLK_F_BLK_SIZE))
+    d->blksize = *R(d, VIRTIO_BLK_CFG_BLK_SIZE);
+  else
+    d->blksize = 512;
+
+  d->present = 1;
+  return 1;
+}
+
+void
+virtio_disk_init(void)
+{
+  if(!disk_init(&disks[0], VIRTIO0))
+    panic("could not find virtio disk");
+
+  // the sdcard is optional.
+  disk_init(&disks[1], VIRTIO1);
+
+  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ
+  // and VIRTIO1_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct disk *d)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(d->free[i]){
+      d->free[i] = 0;
       return i;
     }
   }
@@ -168,28 +227,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct disk *d, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(d->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  d->desc[i].addr = 0;
+  d->desc[i].len = 0;
+  d->desc[i].flags = 0;
+  d->desc[i].next = 0;
+  d->free[i] = 1;
+  wakeup(&d->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct disk *d, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = d->desc[i].flags;
+    int nxt = d->desc[i].next;
+    free_desc(d, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -197,46 +256,67 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+static void reap(struct disk *d);
+
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct disk *d, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(d);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(d, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// format and start a request for the nseg data buffers at the
+// physical addresses in addr[], of the lengths in len[], starting
+// at 512-byte sector. b is the list of bufs the request is for,
+// or 0 for a raw request, in which case *wait is decremented
+// when it is done.
+// caller must hold dk->vdisk_lock.
+static void
+start(struct disk *dk, uint64 sector, int write,
+      uint64 *addr, uint *len, int nseg, struct buf *b, int *wait)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  struct virtq_desc *d;
+  int i, head, idx[MAXSEG+2];
 
-  acquire(&disk.vdisk_lock);
+  if(!dk->present)
+    panic("virtio_disk: no disk");
+  if(nseg > MAXSEG)
+    panic("virtio_disk: too many segments");
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // the spec's Section 5.2 says that block operations use
+  // one descriptor for type/reserved/sector, one for each
+  // data buffer, and one for a 1-byte status result.
+  // with indirect descriptors, these live in a table of
+  // the request's own, and the request takes only one
+  // descriptor from the ring.
 
-  // allocate the three descriptors.
-  int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(dk, idx, dk->indirect ? 1 : nseg + 2) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&dk->free[0], &dk->vdisk_lock);
+  }
+  head = idx[0];
+  if(dk->indirect){
+    d = dk->itab[head];
+    for(i = 0; i < nseg + 2; i++)
+      idx[i] = i;
+  } else {
+    d = dk->desc;
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &dk->ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -245,57 +325,257 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  d[idx[0]].addr = (uint64) buf0;
+  d[idx[0]].len = sizeof(struct virtio_blk_req);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1; i <= nseg; i++){
+    d[idx[i]].addr = addr[i-1];
+    d[idx[i]].len = len[i-1];
+    if(write)
+      d[idx[i]].flags = 0; // device reads the buffer
+    else
+      d[idx[i]].flags = VRING_DESC_F_WRITE; // device writes the buffer
+    d[idx[i]].flags |= VRING_DESC_F_NEXT;
+    d[idx[i]].next = idx[i+1];
+  }
+
+  dk->info[head].status = 0xff; // device writes 0 on success
+  d[idx[i]].addr = (uint64) &dk->info[head].status;
+  d[idx[i]].len = 1;
+  d[idx[i]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[i]].next = 0;
+
+  if(dk->indirect){
+    dk->desc[head].addr = (uint64) d;
+    dk->desc[head].len = (nseg + 2) * sizeof(struct virtq_desc);
+    dk->desc[head].flags = VRING_DESC_F_INDIRECT;
+    dk->desc[head].next = 0;
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  // record the waiters for virtio_disk_intr().
+  dk->info[head].b = b;
+  dk->info[head].wait = wait;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  dk->inflight++;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  dk->avail->ring[dk->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  uint16 old = dk->avail->idx;
+  dk->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // with EVENT_IDX, a device that is still working through the
+  // ring says how far it has read, and needs no notification
+  // until we go past that.
+  if(!dk->eventidx ||
+     vring_need_event(dk->used->avail_event, dk->avail->idx, old))
+    *R(dk, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// start a read or write of b, which the caller has locked,
+// and return without waiting for it to finish.
+// b may be the first of a list of locked bufs, linked through
+// qnext, holding consecutive blocks; they all go in one request.
+// virtio_disk_intr() clears each buf's disk flag when it is done;
+// if the buf's async is set, it also hands it to bdone(), otherwise
+// the caller must eventually call virtio_disk_wait() on it.
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  struct disk *dk = devdisk(b->dev);
+  uint64 addr[MAXSEG];
+  uint len[MAXSEG];
+  struct buf *x;
+  int nseg;
+
+  nseg = 0;
+  for(x = b; x; x = x->qnext){
+    if(nseg == MAXSEG)
+      panic("virtio_disk_submit: too many blocks");
+    addr[nseg] = (uint64) x->data;
+    len[nseg++] = BSIZE;
+  }
+
+  acquire(&dk->vdisk_lock);
+  for(x = b; x; x = x->qnext)
+    x->disk = 1;
+  start(dk, b->blockno * (BSIZE / 512), write, addr, len, nseg, b, 0);
+  release(&dk->vdisk_lock);
+}
+
+// read or write the n bytes at virtual address va, starting at
+// 512-byte sector of disk dk, bypassing the buffer cache, and
+// wait for it to finish. n must be a multiple of 512. va is a
+// kernel address if pagetable is 0, and otherwise a user address
+// in pagetable. the memory need not be physically contiguous, so
+// it is cut at page boundaries into up to MAXSEG pieces per
+// request; all requests are started before waiting.
+// returns -1 if part of a user range isn't mapped, after waiting
+// for the requests already started.
+static int
+rawio(struct disk *dk, pagetable_t pagetable, uint64 sector,
+      uint64 va, uint64 n, int write)
+{
+  uint64 addr[MAXSEG], end, m, nbytes;
+  uint len[MAXSEG];
+  int nseg, pending, r;
+
+  end = va + n;
+  pending = 0;
+  r = 0;
+  acquire(&dk->vdisk_lock);
+  while(va < end){
+    nbytes = 0;
+    for(nseg = 0; nseg < MAXSEG && va < end; nseg++){
+      m = PGSIZE - va % PGSIZE;
+      if(m > end - va)
+        m = end - va;
+      if(pagetable == 0)
+        addr[nseg] = kvmpa(va);
+      else if((addr[nseg] = uvmaddr(pagetable, va, !write)) == 0)
+        break;
+      len[nseg] = m;
+      va += m;
+      nbytes += m;
+    }
+    if(nseg < MAXSEG && va < end){
+      // unmapped user page.
+      r = -1;
+      break;
+    }
+    // each request but the last must end on a sector boundary.
+    while(va < end && nbytes % 512){
+      m = nbytes % 512;
+      if(len[nseg-1] <= m)
+        m = len[--nseg];
+      else
+        len[nseg-1] -= m;
+      va -= m;
+      nbytes -= m;
+    }
+    pending++;
+    start(dk, sector, write, addr, len, nseg, 0, &pending);
+    sector += nbytes / 512;
+  }
+  while(pending > 0)
+    sleep(&pending, &dk->vdisk_lock);
+  release(&dk->vdisk_lock);
+  return r;
+}
+
+// read or write the n bytes at kernel virtual address buf,
+// starting at 512-byte sector of disk dn. see rawio().
+void
+virtio_disk_raw(int dn, uint64 sector, char *buf, uint64 n, int write)
+{
+  rawio(&disks[dn], 0, sector, (uint64) buf, n, write);
+}
+
+// read or write the n bytes at user virtual address va in
+// pagetable, starting at 512-byte sector of the disk that holds
+// device dev, moving the data straight between the disk and the
+// user's pages. returns 0, or -1 if the range isn't mapped.
+int
+virtio_disk_user(uint dev, pagetable_t pagetable, uint64 sector,
+                 uint64 va, uint64 n, int write)
+{
+  return rawio(devdisk(dev), pagetable, sector, va, n, write);
+}
+
+// wait for the request started by virtio_disk_submit(b) to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct disk *d = devdisk(b->dev);
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  acquire(&d->vdisk_lock);
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &d->vdisk_lock);
+  }
+  release(&d->vdisk_lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  b->async = 0;
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
+// like virtio_disk_wait(), but first spin for a while
+// checking the used ring, rather than sleeping until the
+// completion interrupt. for short requests whose caller
+// has nothing else to do, this saves the interrupt and
+// a pair of context switches.
+void
+virtio_disk_poll(struct buf *b)
+{
+  struct disk *d = devdisk(b->dev);
+  uint64 end = r_time() + POLLTIME;
+  int done;
+
+  while(r_time() < end){
+    acquire(&d->vdisk_lock);
+    reap(d);
+    done = b->disk == 0;
+    release(&d->vdisk_lock);
+    if(done)
+      return;
   }
+  virtio_disk_wait(b);
+}
+
+// finish the requests the device has put on the used ring.
+// caller must hold d->vdisk_lock.
+static void
+reap(struct disk *d)
+{
+  // the device increments d->used->idx when it
+  // adds an entry to the used ring.
+
+  while(d->used_idx != d->used->idx){
+    __sync_synchronize();
+    int id = d->used->ring[d->used_idx % NUM].id;
+
+    if(d->info[id].status != 0)
+      panic("virtio_disk_intr status");
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+    struct buf *b = d->info[id].b, *nb;
+    int *wait = d->info[id].wait;
+    d->info[id].b = 0;
+    d->info[id].wait = 0;
+    free_chain(d, id);
+    d->inflight--;
+    if(wait && --*wait == 0)
+      wakeup(wait);
+    for(; b; b = nb){
+      nb = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      if(b->async)
+        bdone(b);    // no one is waiting for it
+      else
+        wakeup(b);
+    }
 
-  release(&disk.vdisk_lock);
+    d->used_idx += 1;
+  }
 }
 
+// interrupt from disk n.
 void
-virtio_disk_intr()
+virtio_disk_intr(int n)
 {
-  acquire(&disk.vdisk_lock);
+  struct disk *d = &disks[n];
+
+  acquire(&d->vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
@@ -303,89 +583,92 @@ virtio_disk_intr()
   // the "used" ring, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  *R(d, VIRTIO_MMIO_INTERRUPT_ACK) = *R(d, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  while(1){
+    reap(d);
+    if(!d->eventidx)
+      break;
 
-  while(disk.used_idx != disk.used->idx){
+    // ask for the next interrupt only once three quarters of the
+    // requests still in flight have finished (or the next one,
+    // if there are few), so that a busy disk interrupts once
+    // per batch rather than once per request.
+    int k = d->inflight * 3 / 4;
+    if(k < 1)
+      k = 1;
+    d->avail->used_event = d->used_idx + k - 1;
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+    // the device may have passed that point before it saw the
+    // new used_event, in which case it won't interrupt.
+    if((uint16)(d->used->idx - d->used_idx) < k)
+      break;
   }
 
-  release(&disk.vdisk_lock);
+  release(&d->vdisk_lock);
 }
 
 
+// FatFs drive 0 is the sdcard, disk 1.
+// reads and writes go straight between the device and
+// FatFs's buffer, one request for all count sectors.
+
+// the FatFs sector size: the device's block size,
+// if FatFs is configured to handle it.
+static uint
+sectorsize(void) {
+    uint ss = disks[1].blksize;
+    if (ss < FF_MIN_SS || ss > FF_MAX_SS) ss = FF_MIN_SS;
+    return ss;
+}
+
 DSTATUS disk_status(BYTE pdrv) {
     // Check if the disk is initialized and return status
     if (pdrv != 0) return STA_NOINIT; // Only support one drive
+    if (!disks[1].present) return STA_NOINIT;
     return 0; // Disk is initialized
 }
 
 DSTATUS disk_initialize(BYTE pdrv) {
-    if (pdrv != 0) return STA_NOINIT; // Only support one drive
-    virtio_disk_init(); // Initialize the virtio disk
-    return 0; // Initialization successful
+    // virtio_disk_init() has already set up the device.
+    return disk_status(pdrv);
 }
 
 DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
-    if (pdrv != 0) return RES_PARERR; // Only support one drive
-
-    struct buf b;
-    memmove(b.data, buff, BSIZE);
-    b.blockno = sector;
-    b.disk = 0;
+    if (disk_status(pdrv)) return RES_PARERR; // Only support one drive
 
-    for (UINT i = 0; i < count; i++) {
-        virtio_disk_rw(&b, 0); // Read operation
-        b.blockno++;
-        buff += BSIZE;
-    }
+    uint ss = sectorsize();
+    virtio_disk_raw(1, (uint64)sector * (ss / 512), (char *)buff,
+                    (uint64)count * ss, 0); // Read operation
     return RES_OK;
 }
 
 DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
-    if (pdrv != 0) return RES_PARERR; // Only support one drive
-
-    struct buf b;
-    memmove(b.data, buff, BSIZE);
-    b.blockno = sector;
-    b.disk = 0;
+    if (disk_status(pdrv)) return RES_PARERR; // Only support one drive
 
-    for (UINT i = 0; i < count; i++) {
-        virtio_disk_rw(&b, 1); // Write operation
-        b.blockno++;
-        buff += BSIZE;
-    }
+    uint ss = sectorsize();
+    virtio_disk_raw(1, (uint64)sector * (ss / 512), (char *)buff,
+                    (uint64)count * ss, 1); // Write operation
     return RES_OK;
 }
 
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
-    if (pdrv != 0) return RES_PARERR; // Only support one drive
+    if (disk_status(pdrv)) return RES_PARERR; // Only support one drive
 
     switch (cmd) {
         case CTRL_SYNC:
-            // Ensure all write operations are completed
+            // Writes are complete when disk_write() returns
             return RES_OK;
         case GET_SECTOR_COUNT:
             // Return the total number of sectors
-            *(DWORD *)buff = TOTAL_SECTORS;
+            *(LBA_t *)buff = disks[1].capacity / (sectorsize() / 512);
             return RES_OK;
         case GET_SECTOR_SIZE:
             // Return the sector size
-            *(WORD *)buff = BSIZE;
+            *(WORD *)buff = sectorsize();
             return RES_OK;
         case GET_BLOCK_SIZE:
             // Return the block size
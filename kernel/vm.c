@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -27,8 +29,9 @@ kvmmake(void)
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
-  // virtio mmio disk interface
+  // virtio mmio disk interfaces
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, VIRTIO1, VIRTIO1, PGSIZE, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
@@ -125,6 +128,59 @@ walkaddr(pagetable_t pagetable, uint64 va)
   return pa;
 }
 
+// Look up a user virtual address, return the physical address
+// it maps to, or 0 if it is not mapped for user access (or, if
+// write, not writable). The kernel can use the result as a
+// kernel address, or hand it to a device.
+uint64
+uvmaddr(pagetable_t pagetable, uint64 va, int write)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  if(write && (*pte & PTE_W) == 0)
+    return 0;
+  return PTE2PA(*pte) + va % PGSIZE;
+}
+
+// Like uvmaddr(), but if va isn't mapped as needed and is in
+// one of the current process's mmap() regions, first fault in
+// its page. May sleep, so it doesn't fault if the caller holds
+// a spinlock; such callers must vmatouch() the pages first.
+uint64
+uvmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  uint64 pa;
+  int locked;
+
+  if((pa = uvmaddr(pagetable, va, write)) != 0)
+    return pa;
+  push_off();
+  locked = mycpu()->noff > 1;
+  pop_off();
+  if(!locked && vmafault(pagetable, va, write) == 0)
+    pa = uvmaddr(pagetable, va, write);
+  return pa;
+}
+
+// translate a kernel virtual address to a physical address.
+// only needed for addresses on a kernel stack; the rest of
+// the kernel's memory is direct-mapped.
+uint64
+kvmpa(uint64 va)
+{
+  pte_t *pte;
+
+  pte = walk(kernel_pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0)
+    panic("kvmpa");
+  return PTE2PA(*pte) + va % PGSIZE;
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
@@ -359,17 +415,12 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
-  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-    pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    pa0 = uvmfault(pagetable, va0, 1);
+    if(pa0 == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -392,7 +443,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmfault(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -419,7 +470,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmfault(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -0,0 +1,428 @@
+// Memory-mapped regions: mmap() and munmap().
+//
+// Each process has up to NVMA regions, placed top-down below
+// the trapframe, above the heap. mmap() only records a region;
+// pages are mapped when the process first touches them, by
+// vmafault(), from usertrap() on a page fault or from
+// copyin()/copyout() when a system call touches them.
+//
+// A file page is the page cache's page (see pcache.c). A
+// MAP_SHARED region maps that page itself, so it sees and
+// makes the same changes as read() and write(); munmap() and
+// exit() write back the pages it has written, which vmafault()
+// marks dirty the first time. A
+// MAP_PRIVATE region maps it read-only and copies it on the
+// first write. MAP_ANONYMOUS regions get zeroed pages; shared
+// ones are filled in by mmap() so that fork() can share them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+#include "stat.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+// The region of p that contains va, or 0.
+static struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->len && v->addr <= va && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & (PROT_READ | PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// The lowest address used by p's regions, which the heap
+// must stay below.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 a = TRAPFRAME;
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->len && v->addr < a)
+      a = v->addr;
+  return a;
+}
+
+// Find len bytes of address space for a new region of p,
+// as high as possible. Returns 0 if there is no room.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 a = TRAPFRAME;
+
+  for(;;){
+    if(len > a || a - len < PGROUNDUP(p->sz))
+      return 0;
+    for(v = p->vma; v < p->vma + NVMA; v++)
+      if(v->len && v->addr < a && a - len < v->addr + v->len)
+        break;
+    if(v == p->vma + NVMA)
+      return a - len;
+    a = v->addr;
+  }
+}
+
+// Map the page of pagetable that holds va, if va is in one of the
+// current process's regions and the access is allowed: a page that
+// isn't mapped yet, or, for a write, a private page still shared
+// with the page cache. pagetable must be the current process's.
+// May sleep. Returns 0 if the page is now mapped, -1 if not.
+int
+vmafault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  char *mem, *pg;
+  uint64 va0;
+  int perm, locked;
+
+  if(p == 0 || pagetable != p->pagetable || (v = vmafind(p, va)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if((v->prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) == 0)
+    return -1;
+  va0 = PGROUNDDOWN(va);
+  perm = vmaperm(v);
+
+  // a shared file page is mapped read-only until the first
+  // write to it, which marks it dirty, so that only pages the
+  // process may have changed get written back.
+  if(v->f && (v->flags & MAP_SHARED)){
+    if(write)
+      perm |= PTE_A | PTE_D;
+    else
+      perm &= ~PTE_W;
+  }
+
+  pte = walk(pagetable, va0, 0);
+  if(pte && (*pte & PTE_V)){
+    if(!write || (*pte & PTE_W))
+      return -1;
+    if(v->flags & MAP_SHARED){
+      *pte |= perm;
+      return 0;
+    }
+    // copy on write.
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)PTE2PA(*pte), PGSIZE);
+    kfree((void*)PTE2PA(*pte));
+    *pte = PA2PTE(mem) | perm | PTE_V;
+    return 0;
+  }
+
+  if(v->f == 0){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+  } else {
+    // a system call may fault on a mapping of the very
+    // file it has locked.
+    ip = v->f->ip;
+    if((locked = holdingsleep(&ip->lock)) == 0)
+      ilock(ip);
+    pg = pget(ip, (v->off + va0 - v->addr) / PGSIZE);
+    mem = 0;
+    if(pg && (v->flags & MAP_PRIVATE) && write){
+      if((mem = kalloc()) != 0)
+        memmove(mem, pg, PGSIZE);
+    } else if(pg){
+      // take a reference before the cache can let go of it.
+      kdup(pg);
+      mem = pg;
+      if(v->flags & MAP_PRIVATE)
+        perm &= ~PTE_W;
+    }
+    if(!locked)
+      iunlock(ip);
+    if(mem == 0)
+      return -1;
+  }
+
+  if(mappages(pagetable, va0, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the pages of [va, va+n) that are in the current
+// process's regions, so that a system call can then copy to
+// (if write) or from them while holding locks.
+void
+vmatouch(uint64 va, uint64 n, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+
+  if(va + n < va)
+    return;
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0 || va + n <= v->addr || v->addr + v->len <= va)
+      continue;
+    a = PGROUNDDOWN(va > v->addr ? va : v->addr);
+    end = va + n < v->addr + v->len ? va + n : v->addr + v->len;
+    for(; a < end; a += PGSIZE)
+      if(uvmaddr(p->pagetable, a, write) == 0)
+        vmafault(p->pagetable, a, write);
+  }
+}
+
+// Write a page of a shared file region back to the file,
+// except for any part past the end of the file.
+static void
+vmasync(struct vma *v, uint64 va, char *pa)
+{
+  struct inode *ip = v->f->ip;
+  uint64 off = v->off + va - v->addr;
+  uint n;
+
+  begin_opn(OPBLOCKS(PGSIZE));
+  ilock(ip);
+  if(off < ip->size){
+    n = ip->size - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    writei(ip, 0, (uint64)pa, off, n);
+  }
+  iunlock(ip);
+  end_op();
+}
+
+// Unmap the pages of [a, end) of region v from pagetable,
+// first writing them back if sync is set and v is a shared,
+// writable file region.
+static void
+vmaunmap(struct vma *v, pagetable_t pagetable, uint64 a, uint64 end, int sync)
+{
+  pte_t *pte;
+  char *pa;
+
+  if((v->flags & MAP_SHARED) == 0 || (v->prot & PROT_WRITE) == 0 || v->f == 0)
+    sync = 0;
+  for(; a < end; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = (char*)PTE2PA(*pte);
+    if(sync && (*pte & PTE_D))
+      vmasync(v, a, pa);
+    kfree(pa);
+    *pte = 0;
+  }
+}
+
+// Map a new region of len bytes for the current process, with
+// PROT_ bits prot and MAP_ bits flags, of file f from offset off,
+// or anonymous memory if MAP_ANONYMOUS is set. With MAP_FIXED, the
+// region goes at addr, which must not overlap another region;
+// otherwise addr is ignored. Returns the region's address, or -1.
+uint64
+vmamap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *x;
+  uint64 a;
+
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE)
+    return -1;
+  len = PGROUNDUP(len);
+  if(((flags & MAP_SHARED) == 0) == ((flags & MAP_PRIVATE) == 0))
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+    off = 0;
+  } else {
+    // FAT files aren't in the page cache, which mappings share.
+    if(f == 0 || f->type != FD_INODE || f->ip->type != T_FILE || f->ip->fat || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->len == 0)
+      break;
+  if(v == p->vma + NVMA)
+    return -1;
+
+  if(flags & MAP_FIXED){
+    if(addr % PGSIZE || addr < PGROUNDUP(p->sz) || addr >= TRAPFRAME || len > TRAPFRAME - addr)
+      return -1;
+    for(x = p->vma; x < p->vma + NVMA; x++)
+      if(x->len && x->addr < addr + len && addr < x->addr + x->len)
+        return -1;
+  } else if((addr = vmaplace(p, len)) == 0){
+    return -1;
+  }
+
+  v->addr = addr;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  v->f = f ? filedup(f) : 0;
+
+  if(f == 0 && (flags & MAP_SHARED)){
+    for(a = addr; a < addr + len; a += PGSIZE){
+      if(vmafault(p->pagetable, a, 1) < 0){
+        vmaunmap(v, p->pagetable, addr, a, 0);
+        v->len = 0;
+        return -1;
+      }
+    }
+  }
+  return addr;
+}
+
+// Unmap [addr, addr+len) from the current process. Regions
+// that cover part of the range shrink, or split in two.
+// Returns 0, or -1 if addr isn't page-aligned or a split
+// region needs a free slot and there is none.
+int
+vmaunmaprange(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+  uint64 end, s, e;
+
+  if(addr % PGSIZE || len == 0 || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0 || end <= v->addr || v->addr + v->len <= addr)
+      continue;
+    s = addr > v->addr ? addr : v->addr;
+    e = end < v->addr + v->len ? end : v->addr + v->len;
+    if(s > v->addr && e < v->addr + v->len){
+      // a hole in the middle: the part above e becomes nv.
+      for(nv = p->vma; nv < p->vma + NVMA; nv++)
+        if(nv->len == 0)
+          break;
+      if(nv == p->vma + NVMA)
+        return -1;
+      *nv = *v;
+      nv->addr = e;
+      nv->len = v->addr + v->len - e;
+      nv->off = v->off + (e - v->addr);
+      if(nv->f)
+        filedup(nv->f);
+      vmaunmap(v, p->pagetable, s, e, 1);
+      v->len = s - v->addr;
+      continue;
+    }
+    vmaunmap(v, p->pagetable, s, e, 1);
+    if(s == v->addr && e == v->addr + v->len){
+      if(v->f)
+        fileclose(v->f);
+      memset(v, 0, sizeof(*v));
+    } else if(s == v->addr){
+      v->off += e - s;
+      v->addr = e;
+      v->len -= e - s;
+    } else {
+      v->len = s - v->addr;
+    }
+  }
+  return 0;
+}
+
+// Unmap all of p's regions from pagetable, which is p's page
+// table or, in exec(), the one it is giving up.
+void
+vmaclear(struct proc *p, pagetable_t pagetable)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0)
+      continue;
+    vmaunmap(v, pagetable, v->addr, v->addr + v->len, 1);
+    if(v->f)
+      fileclose(v->f);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Give child np copies of p's regions, for fork(). Pages of
+// shared regions, and private pages still shared with the page
+// cache, are shared; the other private pages are copied.
+// Doesn't sleep. Returns 0, or -1 if out of memory.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  uint64 a, pa;
+  char *mem;
+  int flags;
+
+  for(v = p->vma, nv = np->vma; v < p->vma + NVMA; v++, nv++){
+    if(v->len == 0)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if((v->flags & MAP_PRIVATE) && (flags & PTE_W)){
+        if((mem = kalloc()) == 0)
+          goto bad;
+        memmove(mem, (char*)pa, PGSIZE);
+      } else {
+        kdup((void*)pa);
+        mem = (char*)pa;
+      }
+      if(mappages(np->pagetable, a, PGSIZE, (uint64)mem, flags & ~PTE_V) != 0){
+        kfree(mem);
+        goto bad;
+      }
+    }
+  }
+  return 0;
+
+ bad:
+  // p still holds the files, so these fileclose()s don't sleep.
+  for(nv = np->vma; nv < np->vma + NVMA; nv++){
+    if(nv->len == 0)
+      continue;
+    vmaunmap(nv, np->pagetable, nv->addr, nv->addr + nv->len, 0);
+    if(nv->f)
+      fileclose(nv->f);
+    memset(nv, 0, sizeof(*nv));
+  }
+  return -1;
+}
@@ -16,13 +16,17 @@
 #endif
 
 #define NINODES 200
+#define NGROUPS 4
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/BPB + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// [ boot block | sb block | log | group 0 | group 1 | ... ]
+// with each group [ inode blocks | free bit map | data blocks ]
+
+int nlog = 4*(1+LOGSIZE)+1;  // header, room for 4 full transactions
+int gstart;   // first block of group 0
+int gsize;    // blocks per group
+int ginodes = (NINODES / NGROUPS + 63) / 64 * 64;  // inodes per group
+int ginodeblocks;  // inode blocks per group
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -33,13 +37,16 @@ uint freeinode = 1;
 uint freeblock;
 
 
-void balloc(int);
+void balloc(void);
+uint allocblock(void);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint fmap(struct dinode *din, uint fbn);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, struct dirent *de, int n);
 void die(const char *);
 
 // convert to riscv byte order
@@ -68,11 +75,10 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, cc, fd, nde;
+  uint rootino, inum;
+  static struct dirent de[NINODES];
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -84,28 +90,38 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(nlog - 1 >= 2*(1+LOGSIZE) && nlog <= NLOG);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  gstart = 2 + nlog;
+  gsize = (FSSIZE - gstart + NGROUPS - 1) / NGROUPS;
+  assert(gsize <= BPB);
+  assert(ginodes % IPB == 0);
+  ginodeblocks = ginodes / IPB;
+  assert(gsize > ginodeblocks + 1);
+  nmeta = gstart + NGROUPS * (ginodeblocks + 1);
   nblocks = FSSIZE - nmeta;
 
   sb.magic = FSMAGIC;
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(NGROUPS * ginodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.ngroups = xint(NGROUPS);
+  sb.gstart = xint(gstart);
+  sb.gsize = xint(gsize);
+  sb.ginodes = xint(ginodes);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u, %d groups of %d blocks, each inode blocks %u, bitmap blocks 1) blocks %d total %d\n",
+         nmeta, nlog, NGROUPS, gsize, ginodeblocks, nblocks, FSSIZE);
 
-  freeblock = nmeta;     // the first free block that we can allocate
+  // the first free block that we can allocate; mkfs only uses group 0.
+  freeblock = GBASE(0, sb) + ginodeblocks + 1;
 
   for(i = 0; i < FSSIZE; i++)
     wsect(i, zeroes);
@@ -117,15 +133,12 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  // collect the root's entries; wdir() writes them at the end.
+  nde = 0;
+  de[nde].inum = xshort(rootino);
+  strcpy(de[nde++].name, ".");
+  de[nde].inum = xshort(rootino);
+  strcpy(de[nde++].name, "..");
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -151,10 +164,9 @@ main(int argc, char *argv[])
     
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nde < NINODES);
+    de[nde].inum = xshort(inum);
+    strncpy(de[nde++].name, shortname, DIRSIZ);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -162,14 +174,9 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, de, nde);
 
-  balloc(freeblock);
+  balloc();
 
   exit(0);
 }
@@ -225,6 +232,7 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  assert(inum < NGROUPS * ginodes);
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -233,24 +241,64 @@ ialloc(ushort type)
   return inum;
 }
 
+// Write each group's free map: its inode blocks and the map
+// itself are in use, and so is group 0 up to freeblock. Bits
+// past the end of the group or the disk are in use too.
 void
-balloc(int used)
+balloc(void)
 {
   uchar buf[BSIZE];
-  int i;
-
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  int g, i, used;
+
+  printf("balloc: first %d blocks have been allocated\n", freeblock);
+  for(g = 0; g < NGROUPS; g++){
+    bzero(buf, BSIZE);
+    used = g == 0 ? freeblock - GBASE(0, sb) : ginodeblocks + 1;
+    for(i = 0; i < BPB; i++){
+      if(i < used || i >= gsize || GBASE(g, sb) + i >= FSSIZE)
+        buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    wsect(GBMAP(g, sb), buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+}
+
+// Allocate the next block of group 0.
+uint
+allocblock(void)
+{
+  assert(freeblock < GBASE(0, sb) + gsize);
+  return freeblock++;
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Disk address of block fbn of the file whose inode is din,
+// allocating it if it is the first block past the end. mkfs
+// allocates blocks in order, so files mostly take one extent,
+// and never more than fit in the inode.
+uint
+fmap(struct dinode *din, uint fbn)
+{
+  uint x;
+  int i;
+
+  x = 0;
+  for(i = 0; i < NEXTENT && xint(din->ext[i].len); i++){
+    if(fbn < x + xint(din->ext[i].len))
+      return xint(din->ext[i].start) + fbn - x;
+    x += xint(din->ext[i].len);
+  }
+  assert(fbn == x);
+  if(i > 0 && xint(din->ext[i-1].start) + xint(din->ext[i-1].len) == freeblock){
+    din->ext[i-1].len = xint(xint(din->ext[i-1].len) + 1);
+  } else {
+    assert(i < NEXTENT);
+    din->ext[i].start = xint(freeblock);
+    din->ext[i].len = xint(1);
+  }
+  return allocblock();
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -258,7 +306,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,22 +314,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -295,6 +327,77 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Same as dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Write the n entries in de, starting with "." and "..", as the
+// contents of directory inum: linear if they fit in DIRLINEAR
+// blocks, and indexed otherwise, in as few buckets as hold them.
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+  static char dir[NDIRINDEX][BSIZE];
+  struct dirindex x;
+  struct dinode din;
+  struct dirent *d;
+  int i, j, b, depth, nb;
+  uint ia;
+
+  if(n <= DIRLINEAR*DPB){
+    // leave room to grow in the last block.
+    nb = n / DPB + 1 < DIRLINEAR ? n / DPB + 1 : DIRLINEAR;
+    memset(dir, 0, sizeof(dir));
+    memmove(dir, de, n * sizeof(*de));
+    iappend(inum, dir, nb * BSIZE);
+    return;
+  }
+
+  for(depth = 1; ; depth++){
+    assert((1 << depth) <= NDIRINDEX);
+    nb = 1 << depth;
+    memset(dir, 0, sizeof(dir));
+    memmove(dir[0], de, 2 * sizeof(*de));
+    for(i = 2; i < n; i++){
+      b = dirhash(de[i].name) % nb;
+      d = (struct dirent*)dir[b];
+      for(j = b == 0 ? 2 : 0; j < DPB && d[j].inum != 0; j++)
+        ;
+      if(j == DPB)
+        break;
+      d[j] = de[i];
+    }
+    if(i == n)
+      break;
+  }
+  iappend(inum, dir, nb * BSIZE);
+
+  bzero(&x, sizeof(x));
+  x.depth = xshort(depth);
+  for(b = 0; b < nb; b++){
+    x.bucket[b] = xshort(b);
+    x.ldepth[b] = depth;
+  }
+  ia = allocblock();
+  memset(dir[0], 0, BSIZE);
+  memmove(dir[0], &x, sizeof(x));
+  wsect(ia, dir[0]);
+
+  rinode(inum, &din);
+  din.major = xshort(ia >> 16);
+  din.minor = xshort(ia & 0xffff);
+  winode(inum, &din);
+}
+
 void
 die(const char *s)
 {
@@ -23,6 +23,12 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int shutdown(void);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int sendfile(int, int, uint64*, int);
+int copy_file_range(int, uint64*, int, uint64*, int, int);
+int mount(const char*, const char*, const char*, uint64, void*);
+int umount2(const char*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
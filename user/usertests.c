@@ -422,6 +422,53 @@ truncate3(char *s)
   exit(xstatus);
 }
   
+// truncate a file below where an open reader has read
+// ahead to, then read on: the read-ahead must stop at the
+// new end of the file rather than map blocks past it.
+void
+truncate4(char *s)
+{
+  int fd1, fd2, i, n;
+
+  unlink("truncfile");
+  fd1 = open("truncfile", O_CREATE|O_WRONLY);
+  if(fd1 < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', BSIZE);
+  for(i = 0; i < 16; i++){
+    if(write(fd1, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd1);
+
+  fd1 = open("truncfile", O_RDONLY);
+  for(i = 0; i < 8; i++){
+    if(read(fd1, buf, BSIZE) != BSIZE){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+
+  fd2 = open("truncfile", O_WRONLY|O_TRUNC);
+  if(fd2 < 0 || write(fd2, "xyz", 3) != 3){
+    printf("%s: truncate failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+
+  n = read(fd1, buf, BSIZE);
+  if(n != 0){
+    printf("%s: read %d bytes past the end, wanted 0\n", s, n);
+    exit(1);
+  }
+  close(fd1);
+  unlink("truncfile");
+}
+
 
 // does chdir() call iput(p->cwd) in a transaction?
 void
@@ -1781,6 +1828,325 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// O_DIRECT reads and writes of whole blocks go between the
+// disk and user memory; the cache must agree with them.
+void
+odirect(char *s)
+{
+  enum { N = 8 };
+  int fd, i;
+
+  unlink("odirect");
+  fd = open("odirect", O_CREATE | O_RDWR | O_DIRECT);
+  if(fd < 0){
+    printf("%s: cannot create odirect\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N*BSIZE; i++)
+    buf[i] = i * 7 + i / BSIZE;
+  if(write(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: direct write failed\n", s);
+    exit(1);
+  }
+  // not aligned: goes through the cache.
+  if(write(fd, "xyz", 3) != 3){
+    printf("%s: unaligned write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read back through the cache.
+  fd = open("odirect", O_RDONLY);
+  memset(buf, 0, BUFSZ);
+  if(read(fd, buf, BUFSZ) != N*BSIZE+3){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N*BSIZE; i++){
+    if(buf[i] != (char)(i * 7 + i / BSIZE)){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(memcmp(buf + N*BSIZE, "xyz", 3) != 0){
+    printf("%s: wrong tail\n", s);
+    exit(1);
+  }
+
+  // overwrite a block that is now cached, then read it all
+  // back directly, including the partial last block.
+  fd = open("odirect", O_RDWR | O_DIRECT);
+  memset(buf, 'a', BSIZE);
+  if(write(fd, buf, BSIZE) != BSIZE){
+    printf("%s: direct overwrite failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("odirect", O_RDONLY | O_DIRECT);
+  memset(buf, 0, BUFSZ);
+  if(read(fd, buf, (N+1)*BSIZE) != N*BSIZE+3){
+    printf("%s: direct read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N*BSIZE; i++){
+    if(buf[i] != (i < BSIZE ? 'a' : (char)(i * 7 + i / BSIZE))){
+      printf("%s: wrong direct data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(memcmp(buf + N*BSIZE, "xyz", 3) != 0){
+    printf("%s: wrong direct tail\n", s);
+    exit(1);
+  }
+  unlink("odirect");
+}
+
+// mmap() of a file, private and shared, and of anonymous
+// memory, including a shared region across fork().
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*PGSIZE + 100 };
+  int fd, i, pid, xstatus;
+  char *p, *a;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create mmapfile\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    char c = 'a' + i % 23;
+    if(write(fd, &c, 1) != 1){
+      printf("%s: write mmapfile failed\n", s);
+      exit(1);
+    }
+  }
+
+  // private: sees the file; writes stay in the process.
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < PGROUNDUP(SZ); i++){
+    if(p[i] != (i < SZ ? 'a' + i % 23 : 0)){
+      printf("%s: wrong private data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  p[0] = 'Z';
+  if(munmap(p, SZ) != 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  // shared: writes reach the file.
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  p[PGSIZE] = 'X';
+  if(munmap(p, SZ) != 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read() into a private anonymous region.
+  a = mmap(0, 3*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  if(a[2*PGSIZE + 7] != 0){
+    printf("%s: anonymous memory not zero\n", s);
+    exit(1);
+  }
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, a + 100, SZ) != SZ){
+    printf("%s: read into mmap region failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < SZ; i++){
+    char c = i == 1 ? 'Y' : i == PGSIZE ? 'X' : 'a' + i % 23;
+    if(a[100 + i] != c){
+      printf("%s: wrong file data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  // a hole in the middle.
+  if(munmap(a + PGSIZE, PGSIZE) != 0 || a[0] != 0 || a[2*PGSIZE] != 'a' + (2*PGSIZE - 100) % 23){
+    printf("%s: munmap middle failed\n", s);
+    exit(1);
+  }
+  munmap(a, 3*PGSIZE);
+
+  // shared anonymous memory is shared with a child.
+  a = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap shared anonymous failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[10] = 42;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[10] != 42){
+    printf("%s: shared anonymous memory not shared\n", s);
+    exit(1);
+  }
+  munmap(a, PGSIZE);
+  unlink("mmapfile");
+}
+
+// sendfile() and copy_file_range() copy between files
+// in the kernel.
+void
+sendfiletest(char *s)
+{
+  enum { SZ = 3*BSIZE + 77 };
+  int in, out, i;
+  uint64 off;
+
+  unlink("sendfile.in");
+  unlink("sendfile.out");
+  in = open("sendfile.in", O_CREATE | O_RDWR);
+  out = open("sendfile.out", O_CREATE | O_RDWR);
+  if(in < 0 || out < 0){
+    printf("%s: cannot create files\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 19;
+  if(write(in, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  // from an offset, which in's own offset doesn't change.
+  off = 10;
+  if(sendfile(out, in, &off, SZ) != SZ - 10 || off != SZ){
+    printf("%s: sendfile with offset failed\n", s);
+    exit(1);
+  }
+  if(sendfile(out, in, 0, SZ) != 0){
+    printf("%s: sendfile at end of file copied\n", s);
+    exit(1);
+  }
+
+  // between given offsets, leaving both files' offsets alone.
+  uint64 inoff = 0, outoff = SZ - 10;
+  if(copy_file_range(in, &inoff, out, &outoff, 10, 0) != 10 ||
+     inoff != 10 || outoff != SZ){
+    printf("%s: copy_file_range failed\n", s);
+    exit(1);
+  }
+  close(in);
+  close(out);
+
+  out = open("sendfile.out", O_RDONLY);
+  memset(buf, 0, BUFSZ);
+  if(read(out, buf, BUFSZ) != SZ){
+    printf("%s: wrong size\n", s);
+    exit(1);
+  }
+  close(out);
+  for(i = 0; i < SZ; i++){
+    char c = i < SZ - 10 ? 'a' + (i + 10) % 19 : 'a' + (i - (SZ - 10)) % 19;
+    if(buf[i] != c){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("sendfile.in");
+  unlink("sendfile.out");
+}
+
+// mount the sdcard's FAT volume on a second directory,
+// and use a file on it. skipped if there is no sdcard.
+void
+fatmount(char *s)
+{
+  struct stat st;
+  char data[6];
+  int fd;
+
+  if(mkdir("fatmnt") < 0){
+    printf("%s: mkdir fatmnt failed\n", s);
+    exit(1);
+  }
+  if(mount("/dev/sdcard", "fatmnt", "vfat", 0, 0) < 0){
+    unlink("fatmnt");
+    return;
+  }
+  if(mount("/dev/sdcard", "fatmnt", "vfat", 0, 0) == 0){
+    printf("%s: mounted twice on fatmnt\n", s);
+    exit(1);
+  }
+
+  unlink("fatmnt/fattest.txt");
+  fd = open("fatmnt/fattest.txt", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, "hello", 5) != 5){
+    printf("%s: cannot write fatmnt/fattest.txt\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("fatmnt/fattest.txt", O_RDONLY);
+  if(fd < 0 || read(fd, data, sizeof(data)) != 5 || memcmp(data, "hello", 5) != 0){
+    printf("%s: cannot read back fatmnt/fattest.txt\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.type != T_FILE || st.size != 5){
+    printf("%s: wrong stat of fatmnt/fattest.txt\n", s);
+    exit(1);
+  }
+
+  // busy while the file is open.
+  if(unlink("fatmnt/fattest.txt") == 0 || umount2("fatmnt", 0) == 0){
+    printf("%s: removed a file in use\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(link("fatmnt/fattest.txt", "fatmnt/fatlink.txt") == 0){
+    printf("%s: hard link on FAT\n", s);
+    exit(1);
+  }
+  if(unlink("fatmnt") == 0){
+    printf("%s: unlinked a mount point\n", s);
+    exit(1);
+  }
+  if(unlink("fatmnt/fattest.txt") < 0){
+    printf("%s: unlink fatmnt/fattest.txt failed\n", s);
+    exit(1);
+  }
+  if(umount2("fatmnt", 0) < 0){
+    printf("%s: umount fatmnt failed\n", s);
+    exit(1);
+  }
+  if(open("fatmnt/fattest.txt", O_RDONLY) >= 0 || unlink("fatmnt") < 0){
+    printf("%s: fatmnt still mounted\n", s);
+    exit(1);
+  }
+}
+
+
 void
 fourteen(char *s)
 {
@@ -2599,6 +2965,7 @@ struct test {
   {truncate1, "truncate1"},
   {truncate2, "truncate2"},
   {truncate3, "truncate3"},
+  {truncate4, "truncate4"},
   {openiputtest, "openiput"},
   {exitiputtest, "exitiput"},
   {iputtest, "iput"},
@@ -2628,6 +2995,10 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {odirect, "odirect"},
+  {mmaptest, "mmaptest"},
+  {sendfiletest, "sendfile"},
+  {fatmount, "fatmount"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
@@ -2699,6 +3070,100 @@ bigdir(char *s)
   }
 }
 
+// the kernel's directory hash (FNV-1a).
+static uint
+dhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// fill a bucket of an indexed directory with names whose hashes
+// agree in their low 5 bits, so that the next such name needs
+// several splits in a row before its bucket has room.
+void
+dirsplits(char *s)
+{
+  enum { NLIN = 127, NCOL = 65 };
+  char name[8];
+  int i, n, fd;
+  uint v;
+
+  if(mkdir("dsd") != 0 || chdir("dsd") != 0){
+    printf("%s: mkdir dsd failed\n", s);
+    exit(1);
+  }
+  fd = open("f", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // make the directory indexed (".", "..", f and the x names
+  // overflow its DIRLINEAR blocks), then empty it again.
+  for(i = 1; i < NLIN; i++){
+    name[0] = 'x';
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    name[3] = 0;
+    if(link("f", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 1; i < NLIN; i++){
+    name[0] = 'x';
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    name[3] = 0;
+    unlink(name);
+  }
+
+  // the colliding names' bucket, which mustn't be f's.
+  v = (dhash("f") + 1) & 3;
+  for(i = 0, n = 0; n < NCOL; i++){
+    name[0] = 'c';
+    name[1] = '0' + (i / 4096) % 64;
+    name[2] = '0' + (i / 64) % 64;
+    name[3] = '0' + i % 64;
+    name[4] = 0;
+    if((dhash(name) & 31) != v)
+      continue;
+    if(link("f", name) != 0){
+      printf("%s: link %s failed after %d colliding names\n", s, name, n);
+      exit(1);
+    }
+    n++;
+  }
+
+  for(i = 0, n = 0; n < NCOL; i++){
+    name[0] = 'c';
+    name[1] = '0' + (i / 4096) % 64;
+    name[2] = '0' + (i / 64) % 64;
+    name[3] = '0' + i % 64;
+    name[4] = 0;
+    if((dhash(name) & 31) != v)
+      continue;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+    n++;
+  }
+  unlink("f");
+  chdir("..");
+  if(unlink("dsd") != 0){
+    printf("%s: unlink dsd failed\n", s);
+    exit(1);
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2941,6 +3406,7 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {dirsplits, "dirsplits"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
@@ -36,4 +36,10 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
-entry("shutdown")
\ No newline at end of file
+entry("shutdown");
+entry("mmap");
+entry("munmap");
+entry("sendfile");
+entry("copy_file_range");
+entry("mount");
+entry("umount2");